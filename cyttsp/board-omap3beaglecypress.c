@@ -89,6 +89,7 @@ static struct omap_opp * _omap37x_l3_rate_table         = NULL;
 
 #include <linux/delay.h>
 #include <linux/input/cyttsp.h>
+#include <linux/mutex.h>
 char expansionboard_name[] = CY_SPI_NAME;
 
 #define CY_USE_MT		/* define if using Multi-Touch */
@@ -98,7 +99,7 @@ char expansionboard_name[] = CY_SPI_NAME;
 #if defined(CY_USE_I2C) || defined(CY_USE_SPI)
 
 /* default bootloader keys */
-const u8 dflt_bl_keys[] = {
+static u8 dflt_bl_keys[] = {
 	0, 1, 2, 3, 4, 5, 6, 7
 };
 
@@ -128,83 +129,97 @@ const u8 dflt_bl_keys[] = {
 #define CY_VK3_POS		":475:770:190:60"
 #define CY_VK4_POS 		":665:770:190:60"
 
-/*virtual key support */
+#ifdef CY_USE_I2C
+/* CY_VK*_POS, decoded by the driver instead of through virtualkeys */
+static const struct cyttsp_vkey cyttsp_i2c_vkeys[] = {
+	{ KEY_BACK, 95, 770, 190, 60 },
+	{ KEY_MENU, 285, 770, 190, 60 },
+	{ KEY_HOME, 475, 770, 190, 60 },
+	{ KEY_SEARCH, 665, 770, 190, 60 },
+};
+#endif
+
+/*
+ * virtual key support
+ *
+ * Each panel gets its own attribute under /sys/board_properties, named
+ * after its driver, so two panels can both publish a key map.
+ */
+struct cyttsp_vkey_props {
+	struct kobj_attribute attr;
+	const char *map;
+};
+
+#define CY_VKEY_MAP \
+	__stringify(EV_KEY) ":" __stringify(KEY_BACK) CY_VK1_POS \
+	":" __stringify(EV_KEY) ":" __stringify(KEY_MENU) CY_VK2_POS \
+	":" __stringify(EV_KEY) ":" __stringify(KEY_HOME) CY_VK3_POS \
+	":" __stringify(EV_KEY) ":" __stringify(KEY_SEARCH) CY_VK4_POS
+
 static ssize_t cyttsp_vkeys_show(struct kobject *kobj,
                         struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf,
-	__stringify(EV_KEY) ":" __stringify(KEY_BACK) CY_VK1_POS
-	":" __stringify(EV_KEY) ":" __stringify(KEY_MENU) CY_VK2_POS
-	":" __stringify(EV_KEY) ":" __stringify(KEY_HOME) CY_VK3_POS
-	":" __stringify(EV_KEY) ":" __stringify(KEY_SEARCH) CY_VK4_POS   
-	"\n");
-}
+	struct cyttsp_vkey_props *props =
+		container_of(attr, struct cyttsp_vkey_props, attr);
 
-static struct kobj_attribute cyttsp_vkeys_attr = {
-        .attr = {
-                .mode = S_IRUGO,
-        },
-        .show = &cyttsp_vkeys_show,
-};
+	return sprintf(buf, "%s\n", props->map);
+}
 
-static struct attribute *cyttsp_properties_attrs[] = {
-        &cyttsp_vkeys_attr.attr,
-        NULL
-};
+static struct kobject *cyttsp_properties_kobj;
+static DEFINE_MUTEX(cyttsp_properties_lock);
 
-static struct attribute_group cyttsp_properties_attr_group = {
-        .attrs = cyttsp_properties_attrs,
-};
-
-static int cyttsp_vkey_init(struct cyttsp_platform_data *pd, const char *name)
+static int cyttsp_vkey_init(struct cyttsp_platform_data *pd,
+			    struct cyttsp_vkey_props *props)
 {
-	struct kobject *properties_kobj;
-	int rc;
-	char buf[160];
-	
+	int rc = 0;
+
 	dev_dbg(pd->dev, "%s: init virtual keys\n", __func__);
-	
-	cyttsp_vkeys_attr.attr.name = name;
-	properties_kobj = kobject_create_and_add("board_properties", NULL);
-	rc = 0;
-	if (properties_kobj)
-		rc = sysfs_create_group(properties_kobj,
-			&cyttsp_properties_attr_group);
-
-	if (!properties_kobj)	
-		dev_dbg(pd->dev, "%s: "
-			"setup cyttsp virtual keys fail nobj \n",
-			__func__);
+
+	/* the directory is shared by every panel on the board */
+	mutex_lock(&cyttsp_properties_lock);
+	if (!cyttsp_properties_kobj)
+		cyttsp_properties_kobj =
+			kobject_create_and_add("board_properties", NULL);
+	if (cyttsp_properties_kobj)
+		rc = sysfs_create_file(cyttsp_properties_kobj,
+				       &props->attr.attr);
+	else
+		rc = -ENOMEM;
+	mutex_unlock(&cyttsp_properties_lock);
+
 	if (rc)
 		dev_dbg(pd->dev, "%s: "
 			"setup cyttsp virtual keys fail rc=%d \n",
-			__func__, rc);		
-
-	if (!properties_kobj || rc)
-		dev_dbg(pd->dev, "%s: failed to create board_properties\n",
-			__func__);
-	else {
+			__func__, rc);
+	else
 		dev_dbg(pd->dev, "%s: "
-			"setup cyttsp virtual keys ok name=%s\n",
-			__func__, cyttsp_vkeys_attr.attr.name);		
-		cyttsp_vkeys_show(properties_kobj, &cyttsp_vkeys_attr, buf);
-		dev_dbg(pd->dev, "%s: " "%s""\n", __func__, buf);
-	}
+			"setup cyttsp virtual keys ok name=%s map=%s\n",
+			__func__, props->attr.attr.name, props->map);
+
 	return rc;
-}		
+}
 #endif
 
 #ifdef CY_USE_SPI
 #define CY_SPI_IRQ_GPIO	139	/* Beagleboard extension bus GPIO */
 
+static struct cyttsp_vkey_props cyttsp_spi_vkey_props = {
+	.attr = {
+		.attr = {
+			.name = CY_SPI_VKEY_NAME,
+			.mode = S_IRUGO,
+		},
+		.show = &cyttsp_vkeys_show,
+	},
+	.map = CY_VKEY_MAP,
+};
+
 static int cyttsp_spi_init(struct cyttsp_platform_data *pd, int on)
 {
 	int ret;
 
 	if (on) {
-#ifndef CY_USE_I2C
-		ret = cyttsp_vkey_init(pd, CY_SPI_VKEY_NAME);
-#endif
+		ret = cyttsp_vkey_init(pd, &cyttsp_spi_vkey_props);
 		ret = gpio_request(CY_SPI_IRQ_GPIO, "CYTTSP IRQ GPIO");
 		if (ret) {
 			dev_dbg(pd->dev, "%s: Failed to request GPIO %d\n",
@@ -238,7 +253,8 @@ static struct cyttsp_platform_data cypress_spi_ttsp_platform_data = {
 	/* activate up to 4 groups
 	 * and set active distance
 	 */
-	.gest_set = CY_GEST_GRP_NONE | CY_ACT_DIST,
+	.gest_set = CY_GEST_GRP_NONE,
+	.act_dist = CY_ACT_DIST_DFLT,
 	/* change act_intrvl to customize the Active power state
 	 * scanning/processing refresh interval for Operating mode
 	 */
@@ -253,7 +269,7 @@ static struct cyttsp_platform_data cypress_spi_ttsp_platform_data = {
 	.lp_intrvl = CY_LP_INTRVL_DFLT,
 	.name = CY_SPI_NAME,
 	.irq_gpio = CY_SPI_IRQ_GPIO,
-	.bl_keys = &dflt_bl_keys,
+	.bl_keys = dflt_bl_keys,
 };
 
 static struct spi_board_info omap3beagle_cyttsp_spi_board_info[] __initdata = {
@@ -286,7 +302,6 @@ static int cyttsp_i2c_init(struct cyttsp_platform_data *pd, int on)
 	int ret;
 
 	if (on) {
-		ret = cyttsp_vkey_init(pd, CY_I2C_VKEY_NAME);
 		ret = gpio_request(CY_I2C_IRQ_GPIO, "CYTTSP I2C IRQ GPIO");
 		if (ret) {
 			dev_dbg(pd->dev, "%s: Failed to request GPIO %d\n",
@@ -318,7 +333,8 @@ static struct cyttsp_platform_data cypress_i2c_ttsp_platform_data = {
 	/* activate up to 4 groups
 	 * and set active distance
 	 */
-	.gest_set = CY_GEST_GRP_NONE | CY_ACT_DIST,
+	.gest_set = CY_GEST_GRP_NONE,
+	.act_dist = CY_ACT_DIST_DFLT,
 	/* change act_intrvl to customize the Active power state
 	 * scanning/processing refresh interval for Operating mode
 	 */
@@ -333,7 +349,11 @@ static struct cyttsp_platform_data cypress_i2c_ttsp_platform_data = {
 	.lp_intrvl = CY_LP_INTRVL_DFLT,
 	.name = CY_I2C_NAME,
 	.irq_gpio = CY_I2C_IRQ_GPIO,
-	.bl_keys = &dflt_bl_keys,
+	.bl_keys = dflt_bl_keys,
+	.vkeys = cyttsp_i2c_vkeys,
+	.num_vkeys = ARRAY_SIZE(cyttsp_i2c_vkeys),
+	.vkey_debounce = 1,
+	.reject_frames = 3,
 };
 
 #endif
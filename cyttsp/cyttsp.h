@@ -41,6 +41,21 @@
 #define CY_LP_INTRVL_DFLT 0x0A /* ms */
 /* Active distance in pixels for a gesture to be reported */
 #define CY_ACT_DIST_DFLT 0xF8 /* pixels */
+/*
+ * The active distance register also selects the gesture groups: the high
+ * nibble enables groups, the low nibble is the active distance.
+ */
+#define CY_GEST_GRP_NONE 0x00
+#define CY_GEST_GRP1 0x10
+#define CY_GEST_GRP2 0x20
+#define CY_GEST_GRP3 0x40
+#define CY_GEST_GRP4 0x80
+#define CY_GEST_GRP_MASK 0xF0
+#define CY_ACT_DIST_MASK 0x0F
+/* cyttsp_platform_data.xform, applied in this order before scaling */
+#define CY_XFORM_SWAP_XY 0x01
+#define CY_XFORM_INVERT_X 0x02
+#define CY_XFORM_INVERT_Y 0x04
 
 enum cyttsp_powerstate {
 	CY_IDLE_STATE,
@@ -51,21 +66,150 @@ enum cyttsp_powerstate {
 	CY_INVALID_STATE	/* always last in the list */
 };
 
+/*
+ * A virtual key, given by its centre and size in reported coordinates,
+ * the same way as the virtualkeys board property. Keys usually sit in
+ * a strip below maxy.
+ */
+struct cyttsp_vkey {
+	unsigned int code;	/* KEY_* */
+	u16 x, y;
+	u16 w, h;
+};
+
+/* A gesture from the controller's engine, reported as a key press */
+struct cyttsp_gest_key {
+	u8 gest_id;
+	unsigned int code;	/* KEY_* */
+};
+
+/*
+ * Controller settings for one panel variant, picked by the application
+ * ID its firmware reports in sysinfo mode. Without a match the platform
+ * data's own act_intrvl, tch_tmout, lp_intrvl, act_dist and gest_set
+ * apply. Under the device tree each child node of the controller is one
+ * profile, with u32 properties cypress,app-id, cypress,act-intrvl,
+ * cypress,tch-tmout, cypress,lp-intrvl, cypress,act-dist and
+ * cypress,gest-set; those left out keep the platform data's value.
+ */
+struct cyttsp_profile {
+	u16 app_id;	/* app_idh << 8 | app_idl; 0 matches any */
+	u8 act_intrvl;
+	u8 tch_tmout;
+	u8 lp_intrvl;
+	u8 act_dist;
+	u8 gest_set;
+};
+
+/*
+ * Diagnostic streaming. Writing one of the test modes below to the
+ * diag_mode attribute switches the controller over and every scan lands
+ * in a ring that /dev/cyttsp_diag-<device> can mmap; writing 0
+ * returns to normal touch reporting. The ring starts with this header,
+ * followed by num_frames frames of frame_size bytes. The frame written
+ * last is frames[(head - 1) % num_frames]; a reader that falls behind by
+ * num_frames or more sees seq jump. tail is only used for poll(): it
+ * reports readable while head != tail, and the reader stores head into
+ * tail through its shared mapping once it has caught up.
+ */
+#define CY_DIAG_RAW_MODE 0x40
+#define CY_DIAG_SIG_MODE 0x50
+#define CY_DIAG_IDAC_MODE 0x60
+#define CY_DIAG_RAWBASE_MODE 0x70
+#define CY_DIAG_DATA_SIZE 256
+
+struct cyttsp_diag_frame {
+	__u32 seq;
+	__u16 len;	/* bytes of data, from the host mode register on */
+	__u8 mode;
+	__u8 reserved;
+	__s64 time_ns;	/* CLOCK_MONOTONIC time of the interrupt */
+	__u8 data[CY_DIAG_DATA_SIZE];
+};
+
+struct cyttsp_diag_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 num_frames;
+	__u32 frame_size;
+	__u32 mode;
+	__u32 reserved[3];
+	struct cyttsp_diag_frame frames[0];
+};
+
+/*
+ * Frame trace. While debugfs cyttsp.<device>/trace is held open, every
+ * frame read from the controller is appended to it: a header, then one
+ * record per frame with the bytes read from the host mode register on and
+ * the time since the previous frame. Writing a trace to
+ * cyttsp.<device>/replay feeds it back through the decode path of a
+ * closed device; replay_stats reports what it cost. All fields are
+ * little endian.
+ */
+#define CY_TRACE_MAGIC 0x52545943	/* "CYTR" */
+#define CY_TRACE_VERSION 1
+
+struct cyttsp_trace_hdr {
+	__le32 magic;
+	__le16 version;
+	__le16 reserved;
+};
+
+struct cyttsp_trace_rec {
+	__le32 delta_us;
+	__u8 len;
+	__u8 data[0];
+} __attribute__((packed));
+
 struct cyttsp_platform_data {
 	u32 maxx;
 	u32 maxy;
 	bool use_hndshk;
 	bool use_sleep;
+	bool use_frame_ring;	/* decode and report off the irq thread */
+	bool use_async_init;	/* power on from probe without blocking it */
+	bool use_rate_gov;	/* start with the report rate governor on */
+	bool use_dedup;	/* drop frames that carry nothing but jitter */
+	bool use_gestures;	/* report gestures from the controller */
 	u8 act_dist;	/* Active distance */
+	u8 gest_set;	/* CY_GEST_GRP* enabled with use_gestures */
 	u8 act_intrvl;  /* Active refresh interval; ms */
 	u8 tch_tmout;   /* Active touch timeout; ms */
 	u8 lp_intrvl;   /* Low power refresh interval; ms */
+	u8 jitter;      /* largest change use_dedup treats as noise */
+	u8 predict_ms;  /* report positions extrapolated this far; 0 off */
+	/* controller coordinate range; 0 when it already is maxx/maxy */
+	u32 panel_maxx;
+	u32 panel_maxy;
+	u8 xform;	/* CY_XFORM_* */
+	/*
+	 * Affine calibration applied after scaling, in 16.16 fixed point:
+	 * x' = c[0] x + c[1] y + c[2], y' = c[3] x + c[4] y + c[5].
+	 * All zero means none.
+	 */
+	s32 calib[6];
+	const struct cyttsp_vkey *vkeys;
+	u8 num_vkeys;
+	u8 vkey_debounce;	/* frames on a key before it goes down */
+	/* bad frames in a row that tracks are held through, see palms */
+	u8 reject_frames;
+	const struct cyttsp_gest_key *gest_keys;
+	u8 num_gest_keys;
 	int (*wakeup)(void);
 	int (*init)(void);
 	void (*exit)(void);
 	char *name;
 	s16 irq_gpio;
 	u8 *bl_keys;
+	const char *fw_name;	/* controller firmware image, or NULL */
+	/* SCHED_FIFO priority of the irq thread; 0 keeps the kernel's */
+	u8 irq_prio;
+	unsigned long irq_cpus;	/* cpus for the irq and its thread; 0 any */
+	/* ms without a touch before low power scanning; 0 for the default */
+	u16 idle_ms;
+	/* panel variants; the first match wins, device tree ones if none */
+	const struct cyttsp_profile *profiles;
+	u8 num_profiles;
 };
 
 #endif /* _CYTTSP_H_ */
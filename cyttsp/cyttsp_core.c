@@ -33,13 +33,80 @@
 
 #include <linux/delay.h>
 #include <linux/input.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+#define CY_USE_MT_SLOTS
 #include <linux/input/mt.h>
+#endif
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/pm_runtime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/firmware.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/kfifo.h>
+#include <linux/uaccess.h>
+#ifdef CONFIG_OF
+#include <linux/of.h>
+#endif
+#include <asm/unaligned.h>
+
+/*
+ * Compatibility with the 2.6.32 Android kernels, which also get the
+ * protocol A reporter. The runtime PM shims are in cyttsp_core.h, as the
+ * bus drivers need them too.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33)
+#define IS_ERR_OR_NULL(ptr)         (!(ptr) || IS_ERR(ptr))
+/* no gfp argument yet */
+#define request_firmware_nowait(mod, uevent, name, dev, gfp, context, cont) \
+	request_firmware_nowait(mod, uevent, name, dev, context, cont)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 34)
+#define for_each_set_bit(bit, addr, size) for_each_bit(bit, addr, size)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)
+/* no hints yet; set the affinity instead, and keep it when cleared */
+static inline int irq_set_affinity_hint(unsigned int irq,
+					const struct cpumask *m)
+{
+	return m ? irq_set_affinity(irq, m) : 0;
+}
+#endif
+/* the frame trace is read out through the generic kfifo; replay needs none */
+#if defined(CONFIG_DEBUG_FS) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+#define CY_USE_TRACE
+#endif
 
 /* Bootloader number of command keys */
 #define CY_NUM_BL_KEYS    8
+/* key bytes in a bootloader command, after file offset, 0xFF and command */
+#define CY_BL_KEYS_OFFS   3
+#define CY_BL_CMD_LEN     (CY_BL_KEYS_OFFS + CY_NUM_BL_KEYS)
+/* bootloader commands found in a firmware image */
+#define CY_BL_INIT_LOAD   0x38
+#define CY_BL_WRITE_BLK   0x39
+#define CY_BL_TERMINATE   0x3B
+/* bl_error while a bootload session accepts blocks */
+#define CY_BL_BOOTLOADING 0x20
+/* firmware update timeouts; the whole flash is erased on init load */
+#define CY_FW_INIT_TMOUT  10000 /* ms */
+#define CY_FW_BLK_TMOUT   500 /* ms */
 
 /* helpers */
 #define GET_NUM_TOUCHES(x)          ((x) & 0x0F)
@@ -49,6 +116,7 @@
 #define IS_OPERATIONAL_ERR(x)       ((x) & 0x3F)
 #define GET_HSTMODE(reg)            ((reg & 0x70) >> 4)
 #define GET_BOOTLOADERMODE(reg)     ((reg & 0x10) >> 4)
+#define IS_BL_READY(x)              (((x) & 0xFE) == 0x10)
 
 #define CY_REG_BASE                 0x00
 #define CY_REG_ACT_DIST             0x1E
@@ -57,7 +125,9 @@
 #define CY_REG_LP_INTRVL            (CY_REG_TCH_TMOUT+1)
 #define CY_MAXZ                     255
 #define CY_DELAY_DFLT               20 /* ms */
+#define CY_DELAY_MIN                1 /* ms; first step of the retry backoff */
 #define CY_DELAY_MAX                (500/CY_DELAY_DFLT) /* half second */
+#define CY_ERR_FRAME_MAX            3 /* failed frames in a row before recovery */
 #define CY_ACT_DIST_DFLT            0xF8
 #define CY_HNDSHK_BIT               0x80
 /* device mode bits */
@@ -72,6 +142,30 @@
 #define CY_MAX_FINGER               4
 #define CY_MAX_ID                   16
 
+/* Report rate governor defaults */
+#define CY_NUM_INTRVL               3 /* act_intrvl, tch_tmout, lp_intrvl */
+#define CY_GOV_SPEED_DFLT           16 /* pixels per frame */
+#define CY_GOV_HOLD_DFLT            250 /* ms */
+
+/* Coordinate transform, 16.16 fixed point */
+#define CY_XFORM_SHIFT              16
+#define CY_XFORM_ONE                (1 << CY_XFORM_SHIFT)
+#define CY_XFORM_NUM_COEF           6
+
+/* Touch prediction */
+#define CY_PRED_HIST                4 /* frames of history per track */
+
+/* added to input.h in later kernels; same value, so userspace agrees */
+#ifndef MSC_TIMESTAMP
+#define MSC_TIMESTAMP               0x05
+#endif
+#ifndef MT_TOOL_PALM
+#define MT_TOOL_PALM                0x02
+#endif
+#define CY_PRED_MAX_MS              100
+#define CY_MAX_OF_PROFILES          4
+#define CY_PRED_STALE_US            (500 * 1000) /* history too old to use */
+
 struct cyttsp_tch {
 	__be16 x, y;
 	u8 z;
@@ -95,6 +189,83 @@ struct cyttsp_xydata {
 	u8 tt_reserved;
 } __packed;
 
+/*
+ * Number of bytes to fetch from CY_REG_BASE to cover a given touch count.
+ * A zero count still reads the first touch record so that a new single
+ * finger down does not cost a second bus transaction.
+ */
+static const u8 cyttsp_xydata_len[CY_MAX_FINGER + 1] = {
+	offsetof(struct cyttsp_xydata, tch2),
+	offsetof(struct cyttsp_xydata, tch2),
+	offsetof(struct cyttsp_xydata, gest_cnt),
+	offsetof(struct cyttsp_xydata, tch4),
+	offsetof(struct cyttsp_xydata, tt_undef),
+};
+
+/* Gestures are reported in between the second and the third touch */
+#define CY_GEST_LEN                 offsetof(struct cyttsp_xydata, tch3)
+
+/* Frame ring between the irq thread and the decoder; a power of two */
+#define CY_FRAME_RING_SIZE          4
+
+struct cyttsp_frame {
+	struct cyttsp_xydata xy_data;
+	ktime_t irq_time;
+};
+
+/* struct cyttsp flags bits */
+#define CY_ASYNC_BUSY               0 /* asynchronous touch read in flight */
+#define CY_MODE_WAIT                1 /* irq completes bl_ready, no touch read */
+#define CY_RECONFIG                 2 /* same, for a whole mode sequence */
+#define CY_FW_BUSY                  3 /* firmware request or update pending */
+#define CY_DIAG                     4 /* irq thread streams diagnostic frames */
+#define CY_IRQ_TUNE                 5 /* irq thread has to apply irq_prio/cpus */
+#define CY_TRACE                    6 /* frames are appended to trace_fifo */
+#define CY_REPLAY                   7 /* frames come from a trace, not the part */
+
+/* Frame trace and replay, see struct cyttsp_trace_hdr */
+#define CY_TRACE_FIFO_SIZE          (32 * 1024)
+#define CY_REPLAY_MAX               (1024 * 1024)
+
+/* runtime autosuspend delay when platform data leaves idle_ms at 0 */
+#define CY_IDLE_MS_DFLT             3000
+
+/* irq thread priority when platform data leaves it at 0, as the kernel's */
+#define CY_IRQ_PRIO_DFLT            (MAX_USER_RT_PRIO / 2)
+#ifdef IRQF_NO_THREAD
+#define CY_IRQF_NO_THREAD           IRQF_NO_THREAD
+#else
+#define CY_IRQF_NO_THREAD           0
+#endif
+
+/* Diagnostic ring */
+#define CY_DIAG_FRAMES              64
+#define CY_DIAG_READ_LEN            0xFF /* from CY_REG_BASE, per scan */
+
+/* Latency accounting; buckets are log2(us), the last one is open ended */
+#define CY_LAT_BUCKETS              16
+
+enum cyttsp_lat_stage {
+	CY_LAT_IRQ_WAKE,	/* hard irq to irq thread */
+	CY_LAT_BUS_READ,	/* touch data read */
+	CY_LAT_HNDSHK,		/* flow control handshake write */
+	CY_LAT_REPORT,		/* decode and input_sync */
+	CY_LAT_NUM_STAGES
+};
+
+struct cyttsp_lat_hist {
+	u32 count;
+	u32 max_us;
+	u32 bucket[CY_LAT_BUCKETS];
+};
+
+/* Prediction error, as the distance between predicted and raw position */
+struct cyttsp_pred_stats {
+	u32 count;
+	u32 max_err;
+	u64 sum_err;
+};
+
 /* TTSP System Information interface definition */
 struct cyttsp_sysinfo_data {
 	u8 hst_mode;
@@ -118,6 +289,25 @@ struct cyttsp_sysinfo_data {
 	u8 lp_intrvl;
 };
 
+/*
+ * Firmware image, as loaded by request_firmware(): this header followed by
+ * num_records records, each a __be16 length and a bootloader command that
+ * is written from CY_REG_BASE. The first record is CY_BL_INIT_LOAD, then
+ * come the CY_BL_WRITE_BLK records and finally CY_BL_TERMINATE.
+ */
+#define CY_FW_MAGIC "CYFW"
+
+struct cyttsp_fw_header {
+	u8 magic[4];
+	u8 ttspver_hi;
+	u8 ttspver_lo;
+	u8 appid_hi;
+	u8 appid_lo;
+	u8 appver_hi;
+	u8 appver_lo;
+	__be16 num_records;
+} __packed;
+
 /* TTSP Bootloader Register Map interface definition */
 #define CY_BL_CHKSUM_OK 0x01
 struct cyttsp_bootloader_data {
@@ -139,6 +329,81 @@ struct cyttsp_bootloader_data {
 	u8 cid_2;
 };
 
+struct cyttsp_track {
+	int x, y, z;		/* as last reported */
+	int raw_x, raw_y;	/* as read from the part in the last frame */
+	/* raw positions and frame times, newest at hist[hist_head - 1] */
+	int hist_x[CY_PRED_HIST];
+	int hist_y[CY_PRED_HIST];
+	s64 hist_us[CY_PRED_HIST];
+	u8 hist_head;
+	u8 hist_cnt;
+	/* outstanding prediction, checked against the first frame after it */
+	bool pred_valid;
+	int pred_x, pred_y;
+	s64 pred_us;
+	/* virtual key state, while the track is in cyttsp.vkey_used */
+	s8 vkey;		/* key it went down on, -1 once it slid off */
+	bool vkey_down;
+	u8 vkey_frames;
+	bool palm;		/* reported as MT_TOOL_PALM, see reject_frames */
+};
+
+/*
+ * What power up programs, compiled at probe from the platform data and
+ * the profile picked once sysinfo names the panel, so that bringing the
+ * part up is a matter of writing these out.
+ */
+struct cyttsp_config {
+	u8 bl_cmd[CY_BL_CMD_LEN];	/* exit bootloader, with the keys */
+	u8 intrvl[CY_NUM_INTRVL];
+	u8 act_dist;			/* with gesture groups folded in */
+	const struct cyttsp_profile *profile;
+};
+
+/*
+ * Report rate governor. While any track moves at least speed pixels per
+ * frame the controller scans at fast_intrvl; hold_ms after the last such
+ * frame it goes back to the platform interval, with idle_tmout as touch
+ * timeout so that it reaches its low power interval sooner. idle_tmout
+ * follows the panel profile until it is written through sysfs.
+ */
+struct cyttsp_gov {
+	bool enable;
+	u8 fast_intrvl;
+	u8 idle_tmout;
+	bool idle_tmout_set;		/* written through sysfs */
+	u32 speed;
+	u32 hold_ms;
+	bool fast;			/* fast profile applied */
+	unsigned long last_fast;	/* jiffies */
+	struct mutex lock;
+	struct work_struct work;
+	struct delayed_work decay;
+};
+
+/* Result of the last replay, see cyttsp_replay() */
+struct cyttsp_replay_stats {
+	int result;
+	u32 frames;
+	u32 syncs;		/* frames that produced input events */
+	u32 events;		/* input events passed on, SYN_REPORT included */
+	u32 errors;		/* frames the decoder rejected */
+	u32 dropped;		/* frames lost to a read past the trace */
+	u64 total_ns;
+	u64 max_ns;
+};
+
+/* Bus and recovery counters, exported through debugfs */
+struct cyttsp_err_stats {
+	u32 transient;		/* NAK or sync miss */
+	u32 bus;		/* other bus errors, retried after a delay */
+	u32 frames;		/* frames dropped after all retries */
+	u32 glitches;		/* recoveries that found the part running */
+	u32 resets;		/* recoveries that found the part in its bootloader */
+	u32 failed;		/* recoveries that did not get the part back */
+};
+
 struct cyttsp {
 	struct device *dev;
 	int irq;
@@ -148,19 +413,495 @@ struct cyttsp {
 	struct cyttsp_bus_ops *bus_ops;
 	struct cyttsp_bootloader_data bl_data;
 	struct cyttsp_sysinfo_data sysinfo_data;
+	bool sysinfo_valid;	/* sysinfo_data has been read since power on */
+	/* mode switch polling, kept apart from the frame being decoded */
+	struct cyttsp_xydata mode_data;
+	/* act_intrvl, tch_tmout and lp_intrvl: wanted, in the part, after reset */
+	u8 intrvl[CY_NUM_INTRVL];
+	u8 hw_intrvl[CY_NUM_INTRVL];
+	u8 fw_intrvl[CY_NUM_INTRVL];
+	struct cyttsp_config cfg;
+	struct cyttsp_profile dflt_profile;	/* the platform data's */
+	const struct cyttsp_profile *profiles;
+	u8 num_profiles;
+#ifdef CONFIG_OF
+	struct cyttsp_profile of_profiles[CY_MAX_OF_PROFILES];
+#endif
+	struct cyttsp_track tracks[CY_MAX_ID];
+	u16 prev_used;		/* tracks present in the last reported frame */
+	u16 vkey_used;		/* tracks that went down on a virtual key */
+	u8 gest_id;		/* gesture in the last frame */
+	u8 gest_cnt;
+	int jitter;		/* dedup threshold; -1 reports every frame */
+	int predict_ms;		/* prediction horizon; 0 reports raw positions */
+	/*
+	 * Coordinate transform: xform and calib are the settings, xform_m
+	 * the matrix they compose to. xform_lock guards all three, since a
+	 * frame may be reported from the bus controller's interrupt.
+	 */
+	spinlock_t xform_lock;
+	u8 xform;
+	s32 calib[CY_XFORM_NUM_COEF];
+	s32 xform_m[CY_XFORM_NUM_COEF];
+	bool xform_identity;
+	struct cyttsp_gov gov;
 	struct completion bl_ready;
-	enum cyttsp_powerstate power_state;
+	atomic_t power_state;	/* enum cyttsp_powerstate, see below */
+	u8 prev_tch;	/* touch count of the last frame; sizes the next read */
+	u8 hst_cmd;	/* last host mode written by the handshake */
+	bool hst_cmd_valid;
+	ktime_t irq_time;	/* set by the hard irq handler */
+	unsigned long flags;
+	/* DMA-safe frame buffer provided by the bus driver */
+	struct cyttsp_xydata *xy_data;
+	/* asynchronous touch read state, owned by whoever holds CY_ASYNC_BUSY */
+	u8 async_len;
+	ktime_t async_start;
+	struct work_struct bl_work;	/* recovery, see cyttsp_recover() */
+	bool irq_requested;
+	/* irq thread placement, applied by the thread itself */
+	int irq_prio;
+	struct cpumask irq_mask;	/* empty for any cpu */
+	struct cyttsp_err_stats err;
+	u8 err_frames;		/* frames lost in a row, irq thread only */
+	u32 syncs;		/* frames that produced input events */
+	u8 bad_frames;		/* frames rejected in a row */
+	/* asynchronous bring-up, see cyttsp_platform_data.use_async_init */
+	struct work_struct startup_work;
+	struct completion startup_done;
+	int startup_ret;
+	/* diagnostic streaming, mode changes under gov.lock */
+	u8 diag_mode;
+	u8 *diag_buf;		/* DMA-safe bounce for one raw frame */
+	struct cyttsp_diag_ring *diag_ring;	/* vmalloc_user, mmap'd */
+	size_t diag_size;
+	wait_queue_head_t diag_wait;
+	struct miscdevice diag_misc;
+	char diag_name[40];
+	bool diag_registered;
+	/* firmware update, see cyttsp_platform_data.fw_name */
+	struct completion fw_done;
+	bool fw_force;
+	/*
+	 * Optional single producer (frame reader), single consumer (decoder)
+	 * ring. ring_head is only written by the producer and ring_tail only
+	 * by the consumer.
+	 */
+	struct workqueue_struct *ring_wq;
+	struct work_struct ring_work;
+	unsigned int ring_head;
+	unsigned int ring_tail;
+	u32 ring_overruns;
+	struct cyttsp_frame ring[CY_FRAME_RING_SIZE];
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *dbg_dir;
+	/* each stage has a single writer, so no locking is needed */
+	struct cyttsp_lat_hist lat[CY_LAT_NUM_STAGES];
+	struct cyttsp_pred_stats pred;
+	/* frame trace; the frame readers produce, trace readers consume */
+#ifdef CY_USE_TRACE
+	struct kfifo trace_fifo;
+	wait_queue_head_t trace_wait;
+#endif
+	struct mutex trace_lock;
+	bool trace_open;
+	bool trace_hdr;		/* header not read yet */
+	ktime_t trace_last;
+	u32 trace_drops;
+	struct cyttsp_replay_stats replay;
+	u32 replay_events;	/* counted by cyttsp_replay_handler */
+#endif
 };
 
-static const u8 bl_command[] = {
+/*
+ * The irq thread reads the power state on every frame while suspend,
+ * resume and bootloader recovery change it, so it is kept atomic rather
+ * than locked. The touch path only runs in ACTIVE and LOW_PWR; whoever
+ * leaves those states sets the new state first and then synchronizes with
+ * the irq before touching the bus, see cyttsp_quiesce().
+ */
+static inline enum cyttsp_powerstate cyttsp_get_state(struct cyttsp *ts)
+{
+	return atomic_read(&ts->power_state);
+}
+
+static inline void cyttsp_set_state(struct cyttsp *ts,
+				    enum cyttsp_powerstate state)
+{
+	atomic_set(&ts->power_state, state);
+}
+
+static inline bool cyttsp_touch_state(enum cyttsp_powerstate state)
+{
+	return state == CY_ACTIVE_STATE || state == CY_LOW_PWR_STATE;
+}
+
+static const u8 bl_command[CY_BL_CMD_LEN] = {
 	0x00,			/* file offset */
 	0xFF,			/* command */
 	0xA5,			/* exit bootloader command */
 	0, 1, 2, 3, 4, 5, 6, 7	/* default keys */
 };
 
-static int ttsp_read_block_data(struct cyttsp *ts, u8 command,
-	u8 length, void *buf)
+#ifdef CONFIG_OF
+static u8 cyttsp_of_u8(const struct device_node *np, const char *name,
+		       u8 dflt)
+{
+	const __be32 *val = of_get_property(np, name, NULL);
+
+	return val ? be32_to_cpup(val) : dflt;
+}
+
+static void cyttsp_of_profiles(struct cyttsp *ts)
+{
+	const struct cyttsp_profile *dflt = &ts->dflt_profile;
+	struct cyttsp_profile *p;
+	struct device_node *np;
+	const __be32 *val;
+
+	if (!ts->dev->of_node)
+		return;
+
+	for_each_child_of_node(ts->dev->of_node, np) {
+		if (ts->num_profiles == CY_MAX_OF_PROFILES) {
+			dev_err(ts->dev, "%s: Error, more than %d profiles\n",
+				__func__, CY_MAX_OF_PROFILES);
+			of_node_put(np);
+			break;
+		}
+		p = &ts->of_profiles[ts->num_profiles++];
+		val = of_get_property(np, "cypress,app-id", NULL);
+		p->app_id = val ? be32_to_cpup(val) : 0;
+		p->act_intrvl = cyttsp_of_u8(np, "cypress,act-intrvl",
+					     dflt->act_intrvl);
+		p->tch_tmout = cyttsp_of_u8(np, "cypress,tch-tmout",
+					    dflt->tch_tmout);
+		p->lp_intrvl = cyttsp_of_u8(np, "cypress,lp-intrvl",
+					    dflt->lp_intrvl);
+		p->act_dist = cyttsp_of_u8(np, "cypress,act-dist",
+					   dflt->act_dist);
+		p->gest_set = cyttsp_of_u8(np, "cypress,gest-set",
+					   dflt->gest_set);
+	}
+
+	if (ts->num_profiles)
+		ts->profiles = ts->of_profiles;
+}
+#else
+static inline void cyttsp_of_profiles(struct cyttsp *ts)
+{
+}
+#endif
+
+static void cyttsp_config_set(struct cyttsp *ts,
+			      const struct cyttsp_profile *p)
+{
+	struct cyttsp_config *cfg = &ts->cfg;
+
+	cfg->profile = p;
+	cfg->intrvl[0] = p->act_intrvl;
+	cfg->intrvl[1] = p->tch_tmout;
+	cfg->intrvl[2] = p->lp_intrvl;
+	cfg->act_dist = !ts->platform_data->use_gestures ? p->act_dist :
+		(p->gest_set & CY_GEST_GRP_MASK) |
+		(p->act_dist & CY_ACT_DIST_MASK);
+	memcpy(ts->intrvl, cfg->intrvl, sizeof(ts->intrvl));
+}
+
+static void cyttsp_config_init(struct cyttsp *ts)
+{
+	const struct cyttsp_platform_data *pdata = ts->platform_data;
+	struct cyttsp_profile *dflt = &ts->dflt_profile;
+
+	memcpy(ts->cfg.bl_cmd, bl_command, sizeof(bl_command));
+	if (pdata->bl_keys)
+		memcpy(&ts->cfg.bl_cmd[CY_BL_KEYS_OFFS], pdata->bl_keys,
+		       CY_NUM_BL_KEYS);
+
+	dflt->act_intrvl = pdata->act_intrvl;
+	dflt->tch_tmout = pdata->tch_tmout;
+	dflt->lp_intrvl = pdata->lp_intrvl;
+	dflt->act_dist = pdata->act_dist;
+	dflt->gest_set = pdata->gest_set;
+
+	ts->profiles = pdata->profiles;
+	ts->num_profiles = pdata->num_profiles;
+	if (!ts->num_profiles)
+		cyttsp_of_profiles(ts);
+
+	cyttsp_config_set(ts, dflt);
+}
+
+/*
+ * Pick the profile for the panel sysinfo_data was just read from. Runs
+ * before the part is back in ACTIVE, so the governor is not looking.
+ */
+static void cyttsp_config_select(struct cyttsp *ts)
+{
+	u16 app_id = ts->sysinfo_data.app_idh << 8 | ts->sysinfo_data.app_idl;
+	const struct cyttsp_profile *p = &ts->dflt_profile;
+	int i;
+
+	for (i = 0; i < ts->num_profiles; i++) {
+		if (!ts->profiles[i].app_id ||
+		    ts->profiles[i].app_id == app_id) {
+			p = &ts->profiles[i];
+			break;
+		}
+	}
+
+	if (p == ts->cfg.profile)
+		return;
+
+	dev_info(ts->dev, "%s: app id %04x, %s\n", __func__, app_id,
+		 p == &ts->dflt_profile ? "platform settings" : "profile");
+	cyttsp_config_set(ts, p);
+	if (!ts->gov.idle_tmout_set)
+		ts->gov.idle_tmout = ts->cfg.intrvl[1];
+	ts->gov.fast = false;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static void cyttsp_lat_record(struct cyttsp *ts, enum cyttsp_lat_stage stage,
+			      ktime_t start, ktime_t end)
+{
+	struct cyttsp_lat_hist *h = &ts->lat[stage];
+	s64 us = ktime_us_delta(end, start);
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	else if (us > UINT_MAX)
+		us = UINT_MAX;
+
+	bucket = min_t(int, fls((u32)us), CY_LAT_BUCKETS - 1);
+	h->bucket[bucket]++;
+	h->count++;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+static void cyttsp_pred_record(struct cyttsp *ts, u32 err)
+{
+	ts->pred.count++;
+	ts->pred.sum_err += err;
+	if (err > ts->pred.max_err)
+		ts->pred.max_err = err;
+}
+
+static int cyttsp_lat_show(struct seq_file *m, void *unused)
+{
+	static const char * const stage_name[CY_LAT_NUM_STAGES] = {
+		"irq_wake",
+		"bus_read",
+		"hndshk",
+		"report",
+	};
+	struct cyttsp *ts = m->private;
+	int i, j;
+
+	seq_printf(m, "%-10s %10s %10s", "stage", "count", "max_us");
+	for (j = 0; j < CY_LAT_BUCKETS; j++)
+		seq_printf(m, " <%uus", 1U << j);
+	seq_putc(m, '\n');
+
+	for (i = 0; i < CY_LAT_NUM_STAGES; i++) {
+		const struct cyttsp_lat_hist *h = &ts->lat[i];
+
+		seq_printf(m, "%-10s %10u %10u", stage_name[i],
+			   h->count, h->max_us);
+		for (j = 0; j < CY_LAT_BUCKETS; j++)
+			seq_printf(m, " %u", h->bucket[j]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int cyttsp_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cyttsp_lat_show, inode->i_private);
+}
+
+/* any write clears the histograms */
+static ssize_t cyttsp_lat_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct cyttsp *ts = ((struct seq_file *)file->private_data)->private;
+
+	memset(ts->lat, 0, sizeof(ts->lat));
+
+	return count;
+}
+
+static const struct file_operations cyttsp_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_lat_open,
+	.read = seq_read,
+	.write = cyttsp_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int cyttsp_pred_show(struct seq_file *m, void *unused)
+{
+	struct cyttsp *ts = m->private;
+	const struct cyttsp_pred_stats *p = &ts->pred;
+
+	seq_printf(m, "horizon_ms %d\n", ts->predict_ms);
+	seq_printf(m, "count %u\n", p->count);
+	seq_printf(m, "mean_err %llu\n",
+		   p->count ? div_u64(p->sum_err, p->count) : 0ULL);
+	seq_printf(m, "max_err %u\n", p->max_err);
+
+	return 0;
+}
+
+static int cyttsp_pred_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cyttsp_pred_show, inode->i_private);
+}
+
+/* any write clears the statistics */
+static ssize_t cyttsp_pred_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct cyttsp *ts = ((struct seq_file *)file->private_data)->private;
+
+	memset(&ts->pred, 0, sizeof(ts->pred));
+
+	return count;
+}
+
+static const struct file_operations cyttsp_pred_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_pred_open,
+	.read = seq_read,
+	.write = cyttsp_pred_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* positions as read from the part, before prediction, for calibration */
+static int cyttsp_raw_show(struct seq_file *m, void *unused)
+{
+	struct cyttsp *ts = m->private;
+	u16 used = ACCESS_ONCE(ts->prev_used);
+	const struct cyttsp_track *trk;
+	int i;
+
+	for (i = 0; i < CY_MAX_ID; i++) {
+		if (!(used & (1 << i)))
+			continue;
+		trk = &ts->tracks[i];
+		seq_printf(m, "%2d raw %5d %5d reported %5d %5d %3d\n", i,
+			   trk->raw_x, trk->raw_y, trk->x, trk->y, trk->z);
+	}
+
+	return 0;
+}
+
+static int cyttsp_raw_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cyttsp_raw_show, inode->i_private);
+}
+
+static const struct file_operations cyttsp_raw_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_raw_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void cyttsp_debugfs_init(struct cyttsp *ts)
+{
+	struct dentry *dir;
+	char name[40];
+
+	snprintf(name, sizeof(name), "cyttsp.%s", dev_name(ts->dev));
+	ts->dbg_dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(ts->dbg_dir)) {
+		dev_dbg(ts->dev, "%s: Error, failed to create debugfs dir\n",
+			__func__);
+		ts->dbg_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("latency", S_IRUGO | S_IWUSR, ts->dbg_dir,
+			    ts, &cyttsp_lat_fops);
+	if (ts->ring_wq)
+		debugfs_create_u32("ring_overruns", S_IRUGO, ts->dbg_dir,
+				   &ts->ring_overruns);
+	debugfs_create_file("prediction", S_IRUGO | S_IWUSR, ts->dbg_dir,
+			    ts, &cyttsp_pred_fops);
+	debugfs_create_file("raw", S_IRUGO, ts->dbg_dir, ts, &cyttsp_raw_fops);
+
+	dir = debugfs_create_dir("errors", ts->dbg_dir);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	debugfs_create_u32("transient", S_IRUGO, dir, &ts->err.transient);
+	debugfs_create_u32("bus", S_IRUGO, dir, &ts->err.bus);
+	debugfs_create_u32("frames", S_IRUGO, dir, &ts->err.frames);
+	debugfs_create_u32("glitches", S_IRUGO, dir, &ts->err.glitches);
+	debugfs_create_u32("resets", S_IRUGO, dir, &ts->err.resets);
+	debugfs_create_u32("failed", S_IRUGO, dir, &ts->err.failed);
+}
+
+static void cyttsp_debugfs_exit(struct cyttsp *ts)
+{
+	debugfs_remove_recursive(ts->dbg_dir);
+	ts->dbg_dir = NULL;
+}
+#else
+static inline void cyttsp_lat_record(struct cyttsp *ts,
+				     enum cyttsp_lat_stage stage,
+				     ktime_t start, ktime_t end)
+{
+}
+
+static inline void cyttsp_pred_record(struct cyttsp *ts, u32 err)
+{
+}
+
+static inline void cyttsp_debugfs_init(struct cyttsp *ts)
+{
+}
+
+static inline void cyttsp_debugfs_exit(struct cyttsp *ts)
+{
+}
+#endif
+
+/*
+ * A NAK on i2c or missing sync bytes on spi mean the controller was busy
+ * for that one transfer. A touch frame read tries again at once, as the
+ * part answers the next transfer while it is scanning. Everything else
+ * gets the backoff delay before the next attempt: sync misses are normal
+ * for a while when the bootloader starts, and retrying back to back
+ * would use up all attempts long before it is ready.
+ */
+static bool cyttsp_err_transient(int err)
+{
+	return err == -EAGAIN || err == -ENXIO || err == -EREMOTEIO;
+}
+
+static void cyttsp_retry_wait(struct cyttsp *ts, int err, int tries,
+			      bool frame)
+{
+	if (cyttsp_err_transient(err)) {
+		ts->err.transient++;
+		if (frame)
+			return;
+	} else
+		ts->err.bus++;
+
+	if (tries < CY_NUM_RETRY - 1)
+		msleep(CY_DELAY_MIN << tries);
+}
+
+static int __ttsp_read_block_data(struct cyttsp *ts, u8 command,
+	u8 length, void *buf, bool frame)
 {
 	int retval = -1;
 	int tries;
@@ -171,12 +912,25 @@ static int ttsp_read_block_data(struct cyttsp *ts, u8 command,
 	for (tries = 0; tries < CY_NUM_RETRY && (retval < 0); tries++) {
 		retval = ts->bus_ops->read(ts->bus_ops, command, length, buf);
 		if (retval)
-			msleep(CY_DELAY_DFLT);
+			cyttsp_retry_wait(ts, retval, tries, frame);
 	}
 
 	return retval;
 }
 
+static int ttsp_read_block_data(struct cyttsp *ts, u8 command,
+	u8 length, void *buf)
+{
+	return __ttsp_read_block_data(ts, command, length, buf, false);
+}
+
+/* touch frame reads from the irq thread, see cyttsp_retry_wait() */
+static int ttsp_read_frame_data(struct cyttsp *ts, u8 command,
+	u8 length, void *buf)
+{
+	return __ttsp_read_block_data(ts, command, length, buf, true);
+}
+
 static int ttsp_write_block_data(struct cyttsp *ts, u8 command,
 	u8 length, void *buf)
 {
@@ -186,10 +940,35 @@ static int ttsp_write_block_data(struct cyttsp *ts, u8 command,
 	if (!buf || !length)
 		return -EINVAL;
 
+	/* any host mode write breaks the cached handshake sequence */
+	if (command == CY_REG_BASE)
+		ts->hst_cmd_valid = false;
+
 	for (tries = 0; tries < CY_NUM_RETRY && (retval < 0); tries++) {
 		retval = ts->bus_ops->write(ts->bus_ops, command, length, buf);
 		if (retval)
-			msleep(CY_DELAY_DFLT);
+			cyttsp_retry_wait(ts, retval, tries, false);
+	}
+
+	return retval;
+}
+
+/*
+ * Read touch data and write the handshake for it in one bus transaction.
+ * The controller echoes back the last host mode we wrote, so the value to
+ * write next can be computed before the read completes.
+ */
+static int ttsp_read_block_data_ack(struct cyttsp *ts, u8 command,
+	u8 length, void *buf, u8 ack)
+{
+	int retval = -1;
+	int tries;
+
+	for (tries = 0; tries < CY_NUM_RETRY && (retval < 0); tries++) {
+		retval = ts->bus_ops->read_ack(ts->bus_ops, command, length,
+					       buf, CY_REG_BASE, ack);
+		if (retval)
+			cyttsp_retry_wait(ts, retval, tries, true);
 	}
 
 	return retval;
@@ -235,420 +1014,3005 @@ done:
 	return retval;
 }
 
-static int cyttsp_exit_bl_mode(struct cyttsp *ts)
+/*
+ * Mode switches are acknowledged by the controller with an interrupt. Arm
+ * the completion before sending the command so that an early edge is not
+ * lost; cyttsp_wait_mode() must follow.
+ */
+static void cyttsp_wait_mode_begin(struct cyttsp *ts)
 {
-	int retval;
-	int tries;
-	u8 bl_cmd[sizeof(bl_command)];
+	INIT_COMPLETION(ts->bl_ready);
+	set_bit(CY_MODE_WAIT, &ts->flags);
+}
 
-	memcpy(bl_cmd, bl_command, sizeof(bl_command));
-	if (ts->platform_data->bl_keys)
-		memcpy(&bl_cmd[sizeof(bl_command) - CY_NUM_BL_KEYS],
-			ts->platform_data->bl_keys, sizeof(bl_command));
+/*
+ * Wait until done() reports that the mode switch has completed. Each
+ * check follows either the controller's interrupt or, should it not come,
+ * an exponentially growing delay capped at CY_DELAY_DFLT. Gives up after
+ * CY_DELAY_MAX * CY_DELAY_DFLT ms and returns the last done() result.
+ */
+static int cyttsp_wait_mode(struct cyttsp *ts, int (*done)(struct cyttsp *ts))
+{
+	unsigned long timeout = jiffies +
+		msecs_to_jiffies(CY_DELAY_DFLT * CY_DELAY_MAX);
+	unsigned int delay = CY_DELAY_MIN;
+	int retval;
 
-	retval = ttsp_write_block_data(ts, CY_REG_BASE,
-		sizeof(bl_cmd), (void *)bl_cmd);
+	for (;;) {
+		wait_for_completion_timeout(&ts->bl_ready,
+					    msecs_to_jiffies(delay));
+		INIT_COMPLETION(ts->bl_ready);
 
-	if (retval < 0)
-		return retval;
+		retval = done(ts);
+		if (!retval || time_after(jiffies, timeout))
+			break;
 
-	/* wait for TTSP Device to complete switch to Operational mode */
-	tries = 0;
-	do {
-		msleep(CY_DELAY_DFLT);
-		retval = cyttsp_load_bl_regs(ts);
-	} while ((retval || GET_BOOTLOADERMODE(ts->bl_data.bl_status)) &&
-		(tries++ < CY_DELAY_MAX));
+		delay = min_t(unsigned int, delay << 1, CY_DELAY_DFLT);
+	}
 
-	if (tries >= CY_DELAY_MAX)
-		return -ENODEV;
+	clear_bit(CY_MODE_WAIT, &ts->flags);
 
 	return retval;
 }
 
-static int cyttsp_set_operational_mode(struct cyttsp *ts)
+static int cyttsp_bl_exited(struct cyttsp *ts)
 {
-	struct cyttsp_xydata xy_data;
 	int retval;
-	int tries = 0;
-	u8 cmd = CY_OPERATE_MODE;
-
-	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
 
-	if (retval < 0)
+	retval = cyttsp_load_bl_regs(ts);
+	if (retval)
 		return retval;
 
-	/* wait for TTSP Device to complete switch to Operational mode */
-	do {
-		retval = ttsp_read_block_data(ts, CY_REG_BASE,
-			sizeof(xy_data), &(xy_data));
-	} while ((retval || xy_data.act_dist != CY_ACT_DIST_DFLT) &&
-		 (tries++ < CY_DELAY_MAX));
-
-	if (tries >= CY_DELAY_MAX)
-		return -EAGAIN;
-
-	return retval;
+	return GET_BOOTLOADERMODE(ts->bl_data.bl_status) ? -EAGAIN : 0;
 }
 
-static int cyttsp_set_sysinfo_mode(struct cyttsp *ts)
+static int cyttsp_exit_bl_mode(struct cyttsp *ts)
 {
 	int retval;
-	int tries;
-	u8 cmd = CY_SYSINFO_MODE;
 
-	memset(&(ts->sysinfo_data), 0, sizeof(struct cyttsp_sysinfo_data));
+	cyttsp_wait_mode_begin(ts);
+	retval = ttsp_write_block_data(ts, CY_REG_BASE,
+		sizeof(ts->cfg.bl_cmd), ts->cfg.bl_cmd);
 
-	/* switch to sysinfo mode */
-	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
-	if (retval < 0)
+	if (retval < 0) {
+		clear_bit(CY_MODE_WAIT, &ts->flags);
 		return retval;
+	}
 
-	/* read sysinfo registers */
-	tries = 0;
-	do {
-		msleep(CY_DELAY_DFLT);
-		retval = ttsp_read_block_data(ts, CY_REG_BASE,
-			sizeof(ts->sysinfo_data), &ts->sysinfo_data);
-	} while ((retval || (!ts->sysinfo_data.tts_verh &&
-			     !ts->sysinfo_data.tts_verl)) &&
-		 (tries++ < CY_DELAY_MAX));
-
-	if (tries >= CY_DELAY_MAX)
+	/* wait for TTSP Device to complete switch to Operational mode */
+	retval = cyttsp_wait_mode(ts, cyttsp_bl_exited);
+
+	return retval ? -ENODEV : 0;
+}
+
+static int cyttsp_operational(struct cyttsp *ts)
+{
+	struct cyttsp_xydata *data = &ts->mode_data;
+	int retval;
+
+	retval = ttsp_read_block_data(ts, CY_REG_BASE,
+		offsetof(struct cyttsp_xydata, act_dist) + 1, data);
+	if (retval)
+		return retval;
+
+	if (GET_HSTMODE(data->hst_mode) != GET_HSTMODE(CY_OPERATE_MODE))
+		return -EAGAIN;
+
+	/* the default after a reset, or what was programmed since */
+	return data->act_dist != CY_ACT_DIST_DFLT &&
+		data->act_dist != ts->cfg.act_dist ? -EAGAIN : 0;
+}
+
+static int cyttsp_set_operational_mode(struct cyttsp *ts)
+{
+	int retval;
+	u8 cmd = CY_OPERATE_MODE;
+
+	cyttsp_wait_mode_begin(ts);
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
+
+	if (retval < 0) {
+		clear_bit(CY_MODE_WAIT, &ts->flags);
+		return retval;
+	}
+
+	/* wait for TTSP Device to complete switch to Operational mode */
+	retval = cyttsp_wait_mode(ts, cyttsp_operational);
+
+	return retval ? -EAGAIN : 0;
+}
+
+static int cyttsp_sysinfo_ready(struct cyttsp *ts)
+{
+	int retval;
+
+	retval = ttsp_read_block_data(ts, CY_REG_BASE,
+		sizeof(ts->sysinfo_data), &ts->sysinfo_data);
+	if (retval)
+		return retval;
+
+	/* the interval registers are only there in sysinfo mode */
+	if (GET_HSTMODE(ts->sysinfo_data.hst_mode) !=
+	    GET_HSTMODE(CY_SYSINFO_MODE))
+		return -EAGAIN;
+
+	return (!ts->sysinfo_data.tts_verh && !ts->sysinfo_data.tts_verl) ?
+		-EAGAIN : 0;
+}
+
+static int cyttsp_set_sysinfo_mode(struct cyttsp *ts)
+{
+	int retval;
+	u8 cmd = CY_SYSINFO_MODE;
+
+	memset(&(ts->sysinfo_data), 0, sizeof(struct cyttsp_sysinfo_data));
+
+	/* switch to sysinfo mode */
+	cyttsp_wait_mode_begin(ts);
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
+	if (retval < 0) {
+		clear_bit(CY_MODE_WAIT, &ts->flags);
+		return retval;
+	}
+
+	/* read sysinfo registers */
+	retval = cyttsp_wait_mode(ts, cyttsp_sysinfo_ready);
+	if (retval)
 		return -EAGAIN;
 
+	ts->sysinfo_valid = true;
+	ts->hw_intrvl[0] = ts->sysinfo_data.act_intrvl;
+	ts->hw_intrvl[1] = ts->sysinfo_data.tch_tmout;
+	ts->hw_intrvl[2] = ts->sysinfo_data.lp_intrvl;
+
+	return 0;
+}
+
+/*
+ * hw_intrvl tracks what the part holds: read in sysinfo mode, updated on
+ * every write and reset to fw_intrvl, the defaults read at power on, when
+ * the part resets. Before the first sysinfo read the documented defaults
+ * are all we know.
+ */
+static bool cyttsp_sysinfo_regs_differ(struct cyttsp *ts)
+{
+	if (!ts->sysinfo_valid)
+		return ts->intrvl[0] != CY_ACT_INTRVL_DFLT ||
+		       ts->intrvl[1] != CY_TCH_TMOUT_DFLT ||
+		       ts->intrvl[2] != CY_LP_INTRVL_DFLT;
+
+	return memcmp(ts->intrvl, ts->hw_intrvl, sizeof(ts->intrvl)) != 0;
+}
+
+static int cyttsp_set_sysinfo_regs(struct cyttsp *ts)
+{
+	int retval = 0;
+
+	if (cyttsp_sysinfo_regs_differ(ts)) {
+
+		u8 intrvl_ray[CY_NUM_INTRVL];
+
+		memcpy(intrvl_ray, ts->intrvl, sizeof(intrvl_ray));
+
+		/* set intrvl registers */
+		retval = ttsp_write_block_data(ts,
+				CY_REG_ACT_INTRVL,
+				sizeof(intrvl_ray), intrvl_ray);
+		if (!retval)
+			memcpy(ts->hw_intrvl, intrvl_ray, sizeof(intrvl_ray));
+	}
+
+	return retval;
+}
+
+static int cyttsp_soft_reset(struct cyttsp *ts)
+{
+	int retval;
+	u8 cmd = CY_SOFT_RESET_MODE;
+	long wait_jiffies = msecs_to_jiffies(CY_DELAY_DFLT * CY_DELAY_MAX);
+	/* wait for interrupt to set ready completion */
+	INIT_COMPLETION(ts->bl_ready);
+
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
+	if (retval < 0)
+		return retval;
+
+	return wait_for_completion_timeout(&ts->bl_ready, wait_jiffies);
+}
+
+static int cyttsp_act_dist_setup(struct cyttsp *ts)
+{
+	return ttsp_write_block_data(ts, CY_REG_ACT_DIST,
+		sizeof(ts->cfg.act_dist), &ts->cfg.act_dist);
+}
+
+/*
+ * Write the configuration out to a part in operational mode. After a
+ * reset sysinfo is read afresh, for the firmware's own intervals and the
+ * application ID that picks the profile. Otherwise sysinfo mode is only
+ * entered when the intervals differ from what the part holds, and the
+ * active distance is only written when it is not the reset default. The
+ * writes are not waited on one by one: the part acknowledges the switch
+ * back to operational mode, and that check covers the whole sequence.
+ */
+static int cyttsp_apply_config(struct cyttsp *ts, bool reset)
+{
+	int retval;
+
+	if (reset || cyttsp_sysinfo_regs_differ(ts)) {
+		retval = cyttsp_set_sysinfo_mode(ts);
+		if (retval < 0)
+			return retval;
+
+		if (reset) {
+			memcpy(ts->fw_intrvl, ts->hw_intrvl,
+			       sizeof(ts->fw_intrvl));
+			cyttsp_config_select(ts);
+		}
+
+		retval = cyttsp_set_sysinfo_regs(ts);
+		if (retval < 0)
+			return retval;
+
+		retval = cyttsp_set_operational_mode(ts);
+		if (retval < 0)
+			return retval;
+	}
+
+	if (ts->cfg.act_dist == CY_ACT_DIST_DFLT)
+		return 0;
+
+	return cyttsp_act_dist_setup(ts);
+}
+
+static int cyttsp_hndshk(struct cyttsp *ts, u8 hst_mode)
+{
+	u8 cmd;
+
+	int retval;
+
+	cmd = hst_mode ^ CY_HNDSHK_BIT;
+
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), (u8 *)&cmd);
+	if (!retval) {
+		ts->hst_cmd = cmd;
+		ts->hst_cmd_valid = true;
+	}
+
+	return retval;
+}
+
+/*
+ * Contact reporting. Kernels with MT slots get protocol B, where only
+ * changed contacts are sent and the slot is the controller's track ID.
+ * Older kernels (the 2.6.32 Android images) get protocol A: the input core
+ * keeps no contact state there, so every frame that changed anything
+ * resends all touching contacts from cyttsp.tracks. The choice is made at
+ * build time and the unused half compiles away.
+ */
+#ifdef CY_USE_MT_SLOTS
+static void cyttsp_mt_init(struct input_dev *dev)
+{
+	input_mt_init_slots(dev, CY_MAX_ID);
+	input_set_abs_params(dev, ABS_MT_TOOL_TYPE, 0, MT_TOOL_PALM, 0, 0);
+}
+
+static void cyttsp_mt_destroy(struct input_dev *dev)
+{
+	input_mt_destroy_slots(dev);
+}
+
+static void cyttsp_report_slot(struct input_dev *dev, int slot,
+			       int x, int y, int z)
+{
+	input_mt_slot(dev, slot);
+	input_mt_report_slot_state(dev, MT_TOOL_FINGER, true);
+	input_report_abs(dev, ABS_MT_POSITION_X, x);
+	input_report_abs(dev, ABS_MT_POSITION_Y, y);
+	input_report_abs(dev, ABS_MT_TOUCH_MAJOR, z);
+}
+
+static void cyttsp_report_slot_empty(struct input_dev *dev, int slot)
+{
+	input_mt_slot(dev, slot);
+	input_mt_report_slot_state(dev, MT_TOOL_FINGER, false);
+}
+
+/* a new tool type gives the contact a new tracking ID; it stays put */
+static void cyttsp_report_slot_palm(struct input_dev *dev, int slot)
+{
+	input_mt_slot(dev, slot);
+	input_mt_report_slot_state(dev, MT_TOOL_PALM, true);
+}
+
+static inline void cyttsp_report_frame(struct cyttsp *ts, u16 touching)
+{
+}
+#else
+static void cyttsp_mt_init(struct input_dev *dev)
+{
+	input_set_abs_params(dev, ABS_MT_TRACKING_ID, 0, CY_MAX_ID - 1, 0, 0);
+	input_set_abs_params(dev, ABS_MT_TOOL_TYPE, 0, MT_TOOL_PALM, 0, 0);
+}
+
+static inline void cyttsp_mt_destroy(struct input_dev *dev)
+{
+}
+
+static inline void cyttsp_report_slot(struct input_dev *dev, int slot,
+				      int x, int y, int z)
+{
+}
+
+static inline void cyttsp_report_slot_empty(struct input_dev *dev, int slot)
+{
+}
+
+static inline void cyttsp_report_slot_palm(struct input_dev *dev, int slot)
+{
+}
+
+static void cyttsp_report_frame(struct cyttsp *ts, u16 touching)
+{
+	struct input_dev *dev = ts->input;
+	const struct cyttsp_track *trk;
+	unsigned long ids = touching;
+	int id;
+
+	/* an empty frame still needs one separator to mean "no contacts" */
+	if (!ids)
+		input_mt_sync(dev);
+
+	while (ids) {
+		id = __ffs(ids);
+		ids &= ~(1 << id);
+		trk = &ts->tracks[id];
+		input_report_abs(dev, ABS_MT_TRACKING_ID, id);
+		input_report_abs(dev, ABS_MT_POSITION_X, trk->x);
+		input_report_abs(dev, ABS_MT_POSITION_Y, trk->y);
+		input_report_abs(dev, ABS_MT_TOUCH_MAJOR, trk->z);
+		if (trk->palm)
+			input_report_abs(dev, ABS_MT_TOOL_TYPE, MT_TOOL_PALM);
+		input_mt_sync(dev);
+	}
+}
+#endif
+
+static void cyttsp_extract_track_ids(const struct cyttsp_xydata *xy_data,
+				     int *ids)
+{
+	ids[0] = xy_data->touch12_id >> 4;
+	ids[1] = xy_data->touch12_id & 0xF;
+	ids[2] = xy_data->touch34_id >> 4;
+	ids[3] = xy_data->touch34_id & 0xF;
+}
+
+static const struct cyttsp_tch *
+cyttsp_get_tch(const struct cyttsp_xydata *xy_data, int idx)
+{
+	switch (idx) {
+	case 0:
+		return &xy_data->tch1;
+	case 1:
+		return &xy_data->tch2;
+	case 2:
+		return &xy_data->tch3;
+	case 3:
+		return  &xy_data->tch4;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Compose swap, invert, the scaling from the controller range to
+ * maxx/maxy and the calibration into one 2x3 matrix, so that reporting
+ * a contact costs two multiply-adds per axis. Called with xform_lock held.
+ */
+static void cyttsp_xform_update(struct cyttsp *ts)
+{
+	const struct cyttsp_platform_data *pdata = ts->platform_data;
+	s64 a[CY_XFORM_NUM_COEF] = {
+		CY_XFORM_ONE, 0, 0,
+		0, CY_XFORM_ONE, 0,
+	};
+	s64 b[CY_XFORM_NUM_COEF];
+	const s32 *c = ts->calib;
+	u32 rx = pdata->panel_maxx ? pdata->panel_maxx : pdata->maxx;
+	u32 ry = pdata->panel_maxy ? pdata->panel_maxy : pdata->maxy;
+	bool calib = false;
+	int i;
+
+	if (ts->xform & CY_XFORM_SWAP_XY) {
+		swap(a[0], a[3]);
+		swap(a[1], a[4]);
+		swap(rx, ry);
+	}
+
+	if (ts->xform & CY_XFORM_INVERT_X) {
+		for (i = 0; i < 3; i++)
+			a[i] = -a[i];
+		a[2] += (s64)rx << CY_XFORM_SHIFT;
+	}
+
+	if (ts->xform & CY_XFORM_INVERT_Y) {
+		for (i = 3; i < 6; i++)
+			a[i] = -a[i];
+		a[5] += (s64)ry << CY_XFORM_SHIFT;
+	}
+
+	if (rx && rx != pdata->maxx)
+		for (i = 0; i < 3; i++)
+			a[i] = div_s64(a[i] * pdata->maxx, rx);
+	if (ry && ry != pdata->maxy)
+		for (i = 3; i < 6; i++)
+			a[i] = div_s64(a[i] * pdata->maxy, ry);
+
+	for (i = 0; i < CY_XFORM_NUM_COEF; i++)
+		if (c[i])
+			calib = true;
+
+	if (calib) {
+		for (i = 0; i < 3; i++) {
+			b[i] = (c[0] * a[i] + c[1] * a[3 + i]) >> CY_XFORM_SHIFT;
+			b[3 + i] = (c[3] * a[i] + c[4] * a[3 + i]) >>
+				CY_XFORM_SHIFT;
+		}
+		b[2] += c[2];
+		b[5] += c[5];
+		memcpy(a, b, sizeof(a));
+	}
+
+	ts->xform_identity = true;
+	for (i = 0; i < CY_XFORM_NUM_COEF; i++) {
+		ts->xform_m[i] = a[i];
+		if (a[i] != ((i == 0 || i == 4) ? CY_XFORM_ONE : 0))
+			ts->xform_identity = false;
+	}
+}
+
+static void cyttsp_xform_init(struct cyttsp *ts)
+{
+	spin_lock_init(&ts->xform_lock);
+	ts->xform = ts->platform_data->xform;
+	memcpy(ts->calib, ts->platform_data->calib, sizeof(ts->calib));
+	cyttsp_xform_update(ts);
+}
+
+/* not clamped, the virtual keys live outside of maxx/maxy */
+static inline int cyttsp_xform_axis(const s32 *m, int x, int y)
+{
+	s64 v = (s64)m[0] * x + (s64)m[1] * y + m[2];
+
+	return (v + (CY_XFORM_ONE >> 1)) >> CY_XFORM_SHIFT;
+}
+
+static int cyttsp_vkey_find(struct cyttsp *ts, int x, int y)
+{
+	const struct cyttsp_platform_data *pdata = ts->platform_data;
+	const struct cyttsp_vkey *vk;
+	int i;
+
+	for (i = 0; i < pdata->num_vkeys; i++) {
+		vk = &pdata->vkeys[i];
+		if (abs(x - vk->x) <= vk->w / 2 && abs(y - vk->y) <= vk->h / 2)
+			return i;
+	}
+
+	return -1;
+}
+
+static bool cyttsp_vkey_release(struct cyttsp *ts, struct cyttsp_track *trk)
+{
+	if (!trk->vkey_down)
+		return false;
+
+	input_report_key(ts->input,
+			 ts->platform_data->vkeys[trk->vkey].code, 0);
+	trk->vkey_down = false;
+
+	return true;
+}
+
+/*
+ * A contact that lands on a virtual key belongs to the key row for its
+ * whole life and is never reported as a touch. The key goes down once the
+ * contact has stayed on it for vkey_debounce frames and up when the
+ * contact lifts or slides off. Returns true when the contact was consumed.
+ */
+static bool cyttsp_vkey_track(struct cyttsp *ts, struct cyttsp_track *trk,
+			      int id, bool tracked, int x, int y,
+			      bool *changed)
+{
+	const struct cyttsp_platform_data *pdata = ts->platform_data;
+
+	if (!pdata->num_vkeys)
+		return false;
+
+	if (!tracked) {
+		trk->vkey = cyttsp_vkey_find(ts, x, y);
+		trk->vkey_down = false;
+		trk->vkey_frames = 0;
+		if (trk->vkey >= 0)
+			ts->vkey_used |= 1 << id;
+		else
+			ts->vkey_used &= ~(1 << id);
+	}
+
+	if (!(ts->vkey_used & (1 << id)))
+		return false;
+
+	if (trk->vkey < 0)
+		return true;
+
+	if (cyttsp_vkey_find(ts, x, y) != trk->vkey) {
+		if (cyttsp_vkey_release(ts, trk))
+			*changed = true;
+		trk->vkey = -1;
+	} else if (!trk->vkey_down &&
+		   trk->vkey_frames++ >= pdata->vkey_debounce) {
+		input_report_key(ts->input, pdata->vkeys[trk->vkey].code, 1);
+		trk->vkey_down = true;
+		*changed = true;
+	}
+
+	return true;
+}
+
+/*
+ * Extrapolate a contact along its average velocity over the last
+ * CY_PRED_HIST frames, predict_ms ahead of the frame time, to make up for
+ * the scan and delivery latency. *x and *y come in raw and go out as the
+ * position to report.
+ */
+static void cyttsp_predict(struct cyttsp *ts, struct cyttsp_track *trk,
+			   bool tracked, ktime_t t, int *x, int *y)
+{
+	s64 now = ktime_to_us(t);
+	int horizon = ACCESS_ONCE(ts->predict_ms);
+	int oldest;
+	s64 dt;
+	int px, py;
+
+	if (!tracked) {
+		trk->hist_cnt = 0;
+		trk->pred_valid = false;
+	} else if (trk->pred_valid && now >= trk->pred_us) {
+		cyttsp_pred_record(ts, abs(*x - trk->pred_x) +
+				   abs(*y - trk->pred_y));
+		trk->pred_valid = false;
+	}
+
+	trk->hist_x[trk->hist_head] = *x;
+	trk->hist_y[trk->hist_head] = *y;
+	trk->hist_us[trk->hist_head] = now;
+	trk->hist_head = (trk->hist_head + 1) % CY_PRED_HIST;
+	if (trk->hist_cnt < CY_PRED_HIST)
+		trk->hist_cnt++;
+
+	if (!horizon || trk->hist_cnt < 2)
+		return;
+
+	oldest = (trk->hist_head + CY_PRED_HIST - trk->hist_cnt) %
+		CY_PRED_HIST;
+	dt = now - trk->hist_us[oldest];
+	if (dt <= 0 || dt > CY_PRED_STALE_US)
+		return;
+
+	px = *x + div_s64((s64)(*x - trk->hist_x[oldest]) * horizon * 1000,
+			  (s32)dt);
+	py = *y + div_s64((s64)(*y - trk->hist_y[oldest]) * horizon * 1000,
+			  (s32)dt);
+	px = clamp_t(int, px, 0, ts->platform_data->maxx);
+	py = clamp_t(int, py, 0, ts->platform_data->maxy);
+
+	if (!trk->pred_valid) {
+		trk->pred_valid = true;
+		trk->pred_x = px;
+		trk->pred_y = py;
+		trk->pred_us = now + horizon * 1000;
+	}
+
+	*x = px;
+	*y = py;
+}
+
+/*
+ * End an event packet. The input core stamps events when they are passed
+ * on, after the bus read, so each packet also carries the time of the
+ * interrupt that produced it, in microseconds, as MSC_TIMESTAMP.
+ */
+static void cyttsp_sync(struct cyttsp *ts, ktime_t t)
+{
+	input_event(ts->input, EV_MSC, MSC_TIMESTAMP, (u32)ktime_to_us(t));
+	input_sync(ts->input);
+}
+
+/*
+ * The controller repeats the last gesture in every frame; gest_cnt moves
+ * on when a new one is recognized. Each new gesture is reported once as
+ * MSC_GESTURE and, if the board maps it, as a key press.
+ */
+static bool cyttsp_report_gesture(struct cyttsp *ts,
+				  const struct cyttsp_xydata *xy_data,
+				  ktime_t t)
+{
+	const struct cyttsp_platform_data *pdata = ts->platform_data;
+	bool new_gest;
+	int i;
+
+	new_gest = xy_data->gest_id &&
+		(xy_data->gest_id != ts->gest_id ||
+		 xy_data->gest_cnt != ts->gest_cnt);
+	ts->gest_id = xy_data->gest_id;
+	ts->gest_cnt = xy_data->gest_cnt;
+
+	if (!new_gest)
+		return false;
+
+	input_event(ts->input, EV_MSC, MSC_GESTURE, xy_data->gest_id);
+
+	for (i = 0; i < pdata->num_gest_keys; i++) {
+		if (pdata->gest_keys[i].gest_id != xy_data->gest_id)
+			continue;
+		input_report_key(ts->input, pdata->gest_keys[i].code, 1);
+		cyttsp_sync(ts, t);
+		input_report_key(ts->input, pdata->gest_keys[i].code, 0);
+		break;
+	}
+
+	return true;
+}
+
+/* lift every reported contact, so that none is left stuck down */
+static void cyttsp_release_contacts(struct cyttsp *ts, ktime_t t)
+{
+	unsigned long released = ts->prev_used;
+	int i;
+
+	if (!released)
+		return;
+
+	while (released) {
+		i = __ffs(released);
+		released &= ~(1 << i);
+		if (ts->vkey_used & (1 << i))
+			cyttsp_vkey_release(ts, &ts->tracks[i]);
+		else
+			cyttsp_report_slot_empty(ts->input, i);
+	}
+	ts->vkey_used = 0;
+	ts->prev_used = 0;
+
+	cyttsp_report_frame(ts, 0);
+	cyttsp_sync(ts, t);
+}
+
+/*
+ * A frame the controller flagged as unusable. Tracks are held at their
+ * last reported state for reject_frames such frames in a row, so a short
+ * glitch does not end every contact. A large area that lasts longer turns
+ * the held contacts into palms, for userspace to cancel; other errors end
+ * them.
+ */
+static void cyttsp_reject_frame(struct cyttsp *ts, bool large, ktime_t t)
+{
+	unsigned long held = ts->prev_used & ~ts->vkey_used;
+	bool changed = false;
+	int i;
+
+	if (ts->bad_frames < ts->platform_data->reject_frames) {
+		ts->bad_frames++;
+		return;
+	}
+
+	if (!large) {
+		cyttsp_release_contacts(ts, t);
+		return;
+	}
+
+	while (held) {
+		i = __ffs(held);
+		held &= ~(1 << i);
+		if (ts->tracks[i].palm)
+			continue;
+		ts->tracks[i].palm = true;
+		cyttsp_report_slot_palm(ts->input, i);
+		changed = true;
+	}
+
+	if (changed) {
+		cyttsp_report_frame(ts, ts->prev_used & ~ts->vkey_used);
+		cyttsp_sync(ts, t);
+		ts->syncs++;
+	}
+}
+
+/* Called for every reported frame with the fastest track's movement */
+static void cyttsp_gov_update(struct cyttsp *ts, int speed)
+{
+	struct cyttsp_gov *gov = &ts->gov;
+
+	if (!gov->enable || speed < gov->speed ||
+	    test_bit(CY_REPLAY, &ts->flags))
+		return;
+
+	gov->last_fast = jiffies;
+	if (!gov->fast)
+		schedule_work(&gov->work);
+}
+
+static int cyttsp_report_tchdata(struct cyttsp *ts,
+				 const struct cyttsp_xydata *xy_data,
+				 ktime_t t)
+{
+	u8 num_cur_tch;
+	int i;
+	int ids[4];
+	const struct cyttsp_tch *tch = NULL;
+	struct cyttsp_track *trk;
+	int x, y, z;
+	u16 used = 0;
+	unsigned long released;
+	bool changed = false;
+	bool tracked;
+	int jitter = ACCESS_ONCE(ts->jitter);
+	int speed = 0;
+	s32 m[CY_XFORM_NUM_COEF];
+	bool identity;
+	unsigned long irqflags;
+	ktime_t t_start = ktime_get();
+
+	spin_lock_irqsave(&ts->xform_lock, irqflags);
+	identity = ts->xform_identity;
+	memcpy(m, ts->xform_m, sizeof(m));
+	spin_unlock_irqrestore(&ts->xform_lock, irqflags);
+
+	/* determine number of currently active touches */
+	num_cur_tch = GET_NUM_TOUCHES(xy_data->tt_stat);
+
+	/* check for any error conditions */
+	if (cyttsp_get_state(ts) == CY_IDLE_STATE)
+		return 0;
+	else if (GET_BOOTLOADERMODE(xy_data->tt_mode)) {
+		return -1;
+	} else if (IS_LARGE_AREA(xy_data->tt_stat) == 1) {
+		dev_dbg(ts->dev, "%s: Large area detected\n", __func__);
+		cyttsp_reject_frame(ts, true, t);
+		return 0;
+	} else if (num_cur_tch > CY_MAX_FINGER) {
+		dev_dbg(ts->dev, "%s: Num touch error detected\n", __func__);
+		cyttsp_reject_frame(ts, false, t);
+		return 0;
+	} else if (IS_BAD_PKT(xy_data->tt_mode)) {
+		dev_dbg(ts->dev, "%s: Invalid buffer detected\n", __func__);
+		cyttsp_reject_frame(ts, false, t);
+		return 0;
+	}
+	ts->bad_frames = 0;
+
+	cyttsp_extract_track_ids(xy_data, ids);
+
+	for (i = 0; i < num_cur_tch; i++) {
+		used |= (1 << ids[i]);
+
+		tch = cyttsp_get_tch(xy_data, i);
+
+		x = be16_to_cpu(tch->x);
+		y = be16_to_cpu(tch->y);
+		z = tch->z;
+
+		if (!identity) {
+			int tx = x;
+
+			x = cyttsp_xform_axis(&m[0], tx, y);
+			y = cyttsp_xform_axis(&m[3], tx, y);
+		}
+
+		trk = &ts->tracks[ids[i]];
+		tracked = ts->prev_used & (1 << ids[i]);
+		/* a palm that shrinks back to a finger is a new contact */
+		if (trk->palm) {
+			trk->palm = false;
+			tracked = false;
+		}
+		if (tracked)
+			speed = max(speed, abs(x - trk->raw_x) +
+				    abs(y - trk->raw_y));
+		trk->raw_x = x;
+		trk->raw_y = y;
+
+		if (cyttsp_vkey_track(ts, trk, ids[i], tracked, x, y,
+				      &changed))
+			continue;
+
+		x = clamp_t(int, x, 0, ts->platform_data->maxx);
+		y = clamp_t(int, y, 0, ts->platform_data->maxy);
+
+		cyttsp_predict(ts, trk, tracked, t, &x, &y);
+
+		if (tracked) {
+			/*
+			 * Compared against the last reported position, so
+			 * a slow drift still gets through once it adds up.
+			 */
+			if (abs(x - trk->x) <= jitter &&
+			    abs(y - trk->y) <= jitter &&
+			    abs(z - trk->z) <= jitter)
+				continue;
+		}
+		trk->x = x;
+		trk->y = y;
+		trk->z = z;
+
+		cyttsp_report_slot(ts->input, ids[i], x, y, z);
+		changed = true;
+	}
+
+	/*
+	 * Slots are the controller's track IDs, so a contact keeps its slot
+	 * for as long as the part tracks it. Only contacts that were present
+	 * last frame need releasing; the input core already holds every other
+	 * slot as unused.
+	 */
+	released = ts->prev_used & ~used;
+	while (released) {
+		i = __ffs(released);
+		released &= ~(1 << i);
+		if (ts->vkey_used & (1 << i)) {
+			cyttsp_vkey_release(ts, &ts->tracks[i]);
+			ts->vkey_used &= ~(1 << i);
+		} else
+			cyttsp_report_slot_empty(ts->input, i);
+		changed = true;
+	}
+
+	if (ts->platform_data->use_gestures &&
+	    cyttsp_report_gesture(ts, xy_data, t))
+		changed = true;
+
+	if (changed) {
+		cyttsp_report_frame(ts, used & ~ts->vkey_used);
+		cyttsp_sync(ts, t);
+		ts->syncs++;
+	}
+
+	ts->prev_used = used;
+	cyttsp_gov_update(ts, speed);
+
+	cyttsp_lat_record(ts, CY_LAT_REPORT, t_start, ktime_get());
+
+	return 0;
+}
+
+static void cyttsp_pr_state(struct cyttsp *ts)
+{
+	static const char * const cyttsp_powerstate_string[] = {
+		"IDLE",
+		"ACTIVE",
+		"LOW_PWR",
+		"SLEEP",
+		"BOOTLOADER",
+		"INVALID"
+	};
+
+	enum cyttsp_powerstate state = cyttsp_get_state(ts);
+
+	dev_info(ts->dev, "%s: %s\n", __func__,
+		state < CY_INVALID_STATE ?
+		cyttsp_powerstate_string[state] :
+		"INVALID");
+}
+
+/*
+ * The controller was reset while asleep or running. Its application was
+ * validated and its sysinfo read at power on, so skip the soft reset and
+ * only go through sysinfo mode if the interval registers actually need
+ * rewriting.
+ */
+static int cyttsp_restart_from_bl(struct cyttsp *ts)
+{
+	int retval;
+
+	cyttsp_set_state(ts, CY_BL_STATE);
+	memcpy(ts->hw_intrvl, ts->fw_intrvl, sizeof(ts->hw_intrvl));
+
+	retval = cyttsp_bl_app_valid(ts);
+	if (retval < 0)
+		goto bypass;
+
+	/* new firmware; nothing cached can be trusted */
+	if (ts->bl_data.appver_hi != ts->sysinfo_data.app_verh ||
+	    ts->bl_data.appver_lo != ts->sysinfo_data.app_verl)
+		ts->sysinfo_valid = false;
+
+	if (retval == 0) {
+		retval = cyttsp_exit_bl_mode(ts);
+		if (retval < 0)
+			goto bypass;
+	}
+
+	cyttsp_set_state(ts, CY_IDLE_STATE);
+
+	retval = cyttsp_apply_config(ts, !ts->sysinfo_valid);
+	if (retval < 0)
+		goto bypass;
+
+	cyttsp_set_state(ts, CY_ACTIVE_STATE);
+	retval = 0;
+
+bypass:
+	cyttsp_pr_state(ts);
+	return retval;
+}
+
+/*
+ * Wait until nothing is using the touch path any more: the irq thread,
+ * an asynchronous read in flight and frames still waiting in the decoder
+ * ring. The state must already have been moved out of ACTIVE and LOW_PWR,
+ * or CY_RECONFIG set, so that no new frame starts. A recovery queued
+ * meanwhile finds the new state and leaves.
+ */
+static void cyttsp_quiesce(struct cyttsp *ts)
+{
+	if (ts->irq_requested)
+		synchronize_irq(ts->irq);
+	while (test_bit(CY_ASYNC_BUSY, &ts->flags))
+		msleep(1);
+	if (ts->ring_wq)
+		flush_workqueue(ts->ring_wq);
+}
+
+/*
+ * Keep the touch path off the bus for a mode sequence. Once CY_RECONFIG
+ * is set the irq thread only completes bl_ready; the frame it may already
+ * be reading, acknowledging or decoding is finished before this returns,
+ * so that its handshake cannot land in the middle of the sequence.
+ */
+static void cyttsp_reconfig_begin(struct cyttsp *ts)
+{
+	set_bit(CY_RECONFIG, &ts->flags);
+	cyttsp_quiesce(ts);
+}
+
+static void cyttsp_reconfig_end(struct cyttsp *ts)
+{
+	clear_bit(CY_RECONFIG, &ts->flags);
+}
+
+/*
+ * The frame path gave up on the controller: it reported its bootloader or
+ * stopped answering. This runs from bl_work, so the irq thread is not held
+ * for a bootloader exit, and under gov.lock so that it cannot overlap a
+ * suspend or an interval change. The irq thread is kept off the bus while
+ * hst_mode is looked at and written, or its acknowledge of a late frame
+ * would undo the handshake sent here.
+ */
+static void cyttsp_recover(struct cyttsp *ts)
+{
+	enum cyttsp_powerstate state;
+	int retval;
+
+	mutex_lock(&ts->gov.lock);
+
+	/* a suspend got here first; resume deals with the bootloader */
+	state = cyttsp_get_state(ts);
+	if (!cyttsp_touch_state(state))
+		goto exit;
+
+	cyttsp_reconfig_begin(ts);
+
+	/* in operational mode bl_file and bl_status are hst_mode and tt_mode */
+	retval = cyttsp_load_bl_regs(ts);
+	if (retval) {
+		ts->err.failed++;
+		goto done;
+	}
+
+	if (!GET_BOOTLOADERMODE(ts->bl_data.bl_status)) {
+		/*
+		 * Still running, so only frames were lost. One of them may
+		 * have been a handshake the part is waiting for.
+		 */
+		ts->err.glitches++;
+		if (ts->platform_data->use_hndshk)
+			cyttsp_hndshk(ts, ts->bl_data.bl_file);
+		goto done;
+	}
+
+	if (atomic_cmpxchg(&ts->power_state, state, CY_BL_STATE) != state)
+		goto done;
+	cyttsp_release_contacts(ts, ktime_get());
+
+	dev_info(ts->dev, "%s: controller reset, restarting\n", __func__);
+	retval = cyttsp_restart_from_bl(ts);
+	if (retval < 0)
+		ts->err.failed++;
+	else
+		ts->err.resets++;
+
+done:
+	cyttsp_reconfig_end(ts);
+exit:
+	mutex_unlock(&ts->gov.lock);
+}
+
+/*
+ * Switch the part to new scan intervals. Runs in process context, never
+ * from the irq thread, which it waits for.
+ */
+static int cyttsp_set_intrvl(struct cyttsp *ts, const u8 *intrvl)
+{
+	int retval;
+
+	memcpy(ts->intrvl, intrvl, sizeof(ts->intrvl));
+	if (!cyttsp_sysinfo_regs_differ(ts))
+		return 0;
+
+	cyttsp_reconfig_begin(ts);
+	retval = cyttsp_apply_config(ts, false);
+	cyttsp_reconfig_end(ts);
+	if (retval < 0)
+		dev_err(ts->dev, "%s: Error, failed to set intervals: %d\n",
+			__func__, retval);
+
+	return retval;
+}
+
+static void cyttsp_gov_apply(struct cyttsp *ts)
+{
+	struct cyttsp_gov *gov = &ts->gov;
+	unsigned long until;
+	u8 intrvl[CY_NUM_INTRVL];
+	bool fast;
+
+	mutex_lock(&gov->lock);
+
+	until = gov->last_fast + msecs_to_jiffies(gov->hold_ms);
+	fast = gov->enable && time_before(jiffies, until);
+
+	if (cyttsp_get_state(ts) != CY_ACTIVE_STATE || ts->diag_mode)
+		goto exit;
+
+	if (fast) {
+		intrvl[0] = gov->fast_intrvl;
+		intrvl[1] = ts->cfg.intrvl[1];
+	} else {
+		intrvl[0] = ts->cfg.intrvl[0];
+		intrvl[1] = gov->enable ? gov->idle_tmout : ts->cfg.intrvl[1];
+	}
+	intrvl[2] = ts->cfg.intrvl[2];
+
+	if (!cyttsp_set_intrvl(ts, intrvl))
+		gov->fast = fast;
+
+	/* no frames may come once the fingers lift, so decay on a timer */
+	if (fast)
+		schedule_delayed_work(&gov->decay, until - jiffies + 1);
+
+exit:
+	mutex_unlock(&gov->lock);
+}
+
+static void cyttsp_gov_work(struct work_struct *work)
+{
+	struct cyttsp *ts = container_of(work, struct cyttsp, gov.work);
+
+	cyttsp_gov_apply(ts);
+}
+
+static void cyttsp_gov_decay(struct work_struct *work)
+{
+	struct cyttsp *ts = container_of(work, struct cyttsp, gov.decay.work);
+
+	cyttsp_gov_apply(ts);
+}
+
+static void cyttsp_gov_init(struct cyttsp *ts)
+{
+	struct cyttsp_gov *gov = &ts->gov;
+
+	gov->enable = ts->platform_data->use_rate_gov;
+	gov->fast_intrvl = CY_ACT_INTRVL_DFLT;
+	gov->idle_tmout = ts->cfg.intrvl[1];
+	gov->speed = CY_GOV_SPEED_DFLT;
+	gov->hold_ms = CY_GOV_HOLD_DFLT;
+	mutex_init(&gov->lock);
+	INIT_WORK(&gov->work, cyttsp_gov_work);
+	INIT_DELAYED_WORK(&gov->decay, cyttsp_gov_decay);
+}
+
+static void cyttsp_gov_exit(struct cyttsp *ts)
+{
+	ts->gov.enable = false;
+	cancel_work_sync(&ts->gov.work);
+	cancel_delayed_work_sync(&ts->gov.decay);
+}
+
+#ifdef CY_USE_TRACE
+/*
+ * Append one frame to the trace. Called by whichever path read the frame,
+ * possibly from the bus controller's interrupt; the kfifo needs no lock
+ * with a single producer and a single consumer.
+ */
+static void cyttsp_trace_record(struct cyttsp *ts, const void *data, u8 len)
+{
+	struct cyttsp_trace_rec rec;
+	s64 us = 0;
+
+	if (!test_bit(CY_TRACE, &ts->flags) || test_bit(CY_REPLAY, &ts->flags))
+		return;
+
+	if (kfifo_avail(&ts->trace_fifo) < sizeof(rec) + len) {
+		ts->trace_drops++;
+		return;
+	}
+
+	if (ts->trace_last.tv64)
+		us = clamp_t(s64, ktime_us_delta(ts->irq_time, ts->trace_last),
+			     0, UINT_MAX);
+	ts->trace_last = ts->irq_time;
+
+	rec.delta_us = cpu_to_le32(us);
+	rec.len = len;
+	kfifo_in(&ts->trace_fifo, &rec, sizeof(rec));
+	kfifo_in(&ts->trace_fifo, data, len);
+
+	wake_up_interruptible(&ts->trace_wait);
+}
+
+/* recording lasts for as long as the trace file is open; one reader */
+static int cyttsp_trace_open(struct inode *inode, struct file *file)
+{
+	struct cyttsp *ts = inode->i_private;
+	int retval = 0;
+
+	mutex_lock(&ts->trace_lock);
+	if (ts->trace_open) {
+		retval = -EBUSY;
+		goto exit;
+	}
+	ts->trace_open = true;
+	ts->trace_hdr = true;
+	ts->trace_last = ktime_set(0, 0);
+	ts->trace_drops = 0;
+	/* drop whatever the last recording left; safe from the consumer */
+	kfifo_reset_out(&ts->trace_fifo);
+	set_bit(CY_TRACE, &ts->flags);
+	file->private_data = ts;
+
+exit:
+	mutex_unlock(&ts->trace_lock);
+	return retval ? retval : nonseekable_open(inode, file);
+}
+
+static int cyttsp_trace_release(struct inode *inode, struct file *file)
+{
+	struct cyttsp *ts = file->private_data;
+
+	mutex_lock(&ts->trace_lock);
+	clear_bit(CY_TRACE, &ts->flags);
+	ts->trace_open = false;
+	mutex_unlock(&ts->trace_lock);
+
+	if (ts->trace_drops)
+		dev_info(ts->dev, "%s: %u frames did not fit the trace\n",
+			 __func__, ts->trace_drops);
+
+	return 0;
+}
+
+static ssize_t cyttsp_trace_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct cyttsp *ts = file->private_data;
+	struct cyttsp_trace_hdr hdr;
+	unsigned int copied;
+	int retval;
+
+	if (ts->trace_hdr) {
+		if (count < sizeof(hdr))
+			return -EINVAL;
+		hdr.magic = cpu_to_le32(CY_TRACE_MAGIC);
+		hdr.version = cpu_to_le16(CY_TRACE_VERSION);
+		hdr.reserved = 0;
+		if (copy_to_user(buf, &hdr, sizeof(hdr)))
+			return -EFAULT;
+		ts->trace_hdr = false;
+		return sizeof(hdr);
+	}
+
+	if (kfifo_is_empty(&ts->trace_fifo)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		retval = wait_event_interruptible(ts->trace_wait,
+				!kfifo_is_empty(&ts->trace_fifo));
+		if (retval)
+			return retval;
+	}
+
+	retval = kfifo_to_user(&ts->trace_fifo, buf, count, &copied);
+
+	return retval ? retval : copied;
+}
+
+static const struct file_operations cyttsp_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_trace_open,
+	.read = cyttsp_trace_read,
+	.release = cyttsp_trace_release,
+	.llseek = no_llseek,
+};
+#else
+static inline void cyttsp_trace_record(struct cyttsp *ts, const void *data,
+				       u8 len)
+{
+}
+#endif
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * Stands in for the bus during a replay: reads return the traced frame.
+ * Bytes that were not read live were not traced either, so asking for them
+ * fails the read and the frame is dropped as it was live; the error is a
+ * transient one so that it is not retried with a backoff.
+ */
+struct cyttsp_replay_bus {
+	struct cyttsp_bus_ops ops;
+	const u8 *frame;
+	u8 len;
+};
+
+static s32 cyttsp_replay_read(void *handle, u8 addr, u8 length, void *values)
+{
+	struct cyttsp_replay_bus *rb =
+		container_of(handle, struct cyttsp_replay_bus, ops);
+
+	if (addr + length > rb->len)
+		return -ENXIO;
+
+	memcpy(values, rb->frame + addr, length);
+
+	return 0;
+}
+
+static s32 cyttsp_replay_write(void *handle, u8 addr, u8 length,
+			       const void *values)
+{
+	return 0;
+}
+
+/*
+ * A replay grabs the input device with this, so that what the input core
+ * actually passes on can be counted. The handler is never registered; it
+ * only ever has the replay's own handle.
+ */
+static void cyttsp_replay_event(struct input_handle *handle,
+				unsigned int type, unsigned int code,
+				int value)
+{
+	struct cyttsp *ts = handle->private;
+
+	ts->replay_events++;
+}
+
+static struct input_handler cyttsp_replay_handler = {
+	.event = cyttsp_replay_event,
+	.name = "cyttsp_replay",
+	.h_list = LIST_HEAD_INIT(cyttsp_replay_handler.h_list),
+};
+
+static int cyttsp_handle_tchdata(struct cyttsp *ts);
+
+/*
+ * Run a trace through cyttsp_handle_tchdata() with the bus swapped out,
+ * timing each frame. Frames are decoded inline, and neither recovery nor
+ * the governor is started for them. A device with a controller must be
+ * closed, and its irq is kept off for the duration; tracking state is
+ * reset afterwards. The input device is grabbed meanwhile, so other
+ * handlers do not see the replayed events.
+ */
+static int cyttsp_replay(struct cyttsp *ts, const u8 *buf, size_t len)
+{
+	const struct cyttsp_trace_hdr *hdr = (const void *)buf;
+	const struct cyttsp_trace_rec *rec;
+	struct cyttsp_replay_stats *st = &ts->replay;
+	struct input_handle handle = {
+		.dev = ts->input,
+		.handler = &cyttsp_replay_handler,
+		.name = "cyttsp_replay",
+		.private = ts,
+	};
+	struct cyttsp_replay_bus rb = {
+		.ops = {
+			.read = cyttsp_replay_read,
+			.write = cyttsp_replay_write,
+			.frame_buf = ts->bus_ops->frame_buf,
+			.dev = ts->dev,
+		},
+	};
+	struct cyttsp_bus_ops *bus_ops = ts->bus_ops;
+	enum cyttsp_powerstate state;
+	u8 prev_tch;
+	size_t off = sizeof(*hdr);
+	ktime_t t, start;
+	u64 ns;
+	struct cyttsp_err_stats err;
+	u32 syncs, events;
+	int retval = 0;
+
+	if (len < sizeof(*hdr) ||
+	    le32_to_cpu(hdr->magic) != CY_TRACE_MAGIC ||
+	    le16_to_cpu(hdr->version) != CY_TRACE_VERSION)
+		return -EINVAL;
+
+	/* both take the input mutex */
+	retval = input_register_handle(&handle);
+	if (retval)
+		return retval;
+	retval = input_grab_device(&handle);
+	if (retval)
+		goto unregister;
+
+	mutex_lock(&ts->input->mutex);
+	/* without a controller there are no live frames to get in the way */
+	if (ts->irq && ts->input->users) {
+		retval = -EBUSY;
+		goto unlock_input;
+	}
+	mutex_lock(&ts->gov.lock);
+
+	if (ts->irq_requested)
+		disable_irq(ts->irq);
+	while (test_bit(CY_ASYNC_BUSY, &ts->flags))
+		msleep(1);
+	if (ts->ring_wq)
+		flush_workqueue(ts->ring_wq);
+
+	state = cyttsp_get_state(ts);
+	prev_tch = ts->prev_tch;
+	cyttsp_set_state(ts, CY_ACTIVE_STATE);
+	set_bit(CY_REPLAY, &ts->flags);
+	ts->bus_ops = &rb.ops;
+	ts->prev_tch = 0;
+	syncs = ts->syncs;
+	events = ts->replay_events;
+	err = ts->err;
+	memset(st, 0, sizeof(*st));
+
+	t = ktime_get();
+	while (off + sizeof(*rec) <= len) {
+		rec = (const void *)(buf + off);
+		off += sizeof(*rec) + rec->len;
+		if (off > len || rec->len > CY_FRAME_BUF_SIZE) {
+			retval = -EINVAL;
+			break;
+		}
+
+		t = ktime_add_us(t, le32_to_cpu(rec->delta_us));
+		ts->irq_time = t;
+		rb.frame = rec->data;
+		rb.len = rec->len;
+
+		start = ktime_get();
+		if (cyttsp_handle_tchdata(ts) < 0)
+			st->errors++;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		st->frames++;
+		st->total_ns += ns;
+		if (ns > st->max_ns)
+			st->max_ns = ns;
+	}
+	st->syncs = ts->syncs - syncs;
+	st->events = ts->replay_events - events;
+	st->dropped = ts->err.frames - err.frames;
+	/* the bus error counters are about the part */
+	ts->err = err;
+	st->result = retval;
+
+	cyttsp_release_contacts(ts, ktime_get());
+	clear_bit(CY_REPLAY, &ts->flags);
+	ts->bus_ops = bus_ops;
+	ts->prev_tch = prev_tch;
+	ts->err_frames = 0;
+	ts->hst_cmd_valid = false;
+	cyttsp_set_state(ts, state);
+
+	if (ts->irq_requested)
+		enable_irq(ts->irq);
+
+	mutex_unlock(&ts->gov.lock);
+unlock_input:
+	mutex_unlock(&ts->input->mutex);
+	input_release_device(&handle);
+unregister:
+	input_unregister_handle(&handle);
+	return retval;
+}
+
+struct cyttsp_replay_file {
+	struct cyttsp *ts;
+	u8 *buf;
+	size_t len;
+};
+
+static int cyttsp_replay_open(struct inode *inode, struct file *file)
+{
+	struct cyttsp_replay_file *rf;
+
+	rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+	if (!rf)
+		return -ENOMEM;
+
+	rf->buf = vmalloc(CY_REPLAY_MAX);
+	if (!rf->buf) {
+		kfree(rf);
+		return -ENOMEM;
+	}
+	rf->ts = inode->i_private;
+	file->private_data = rf;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t cyttsp_replay_write_file(struct file *file,
+					const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct cyttsp_replay_file *rf = file->private_data;
+
+	if (count > CY_REPLAY_MAX - rf->len)
+		return -EFBIG;
+	if (copy_from_user(rf->buf + rf->len, buf, count))
+		return -EFAULT;
+	rf->len += count;
+
+	return count;
+}
+
+/* the trace is collected across writes and replayed once it is closed */
+static int cyttsp_replay_release(struct inode *inode, struct file *file)
+{
+	struct cyttsp_replay_file *rf = file->private_data;
+	int retval;
+
+	retval = cyttsp_replay(rf->ts, rf->buf, rf->len);
+	if (retval)
+		dev_err(rf->ts->dev, "%s: Error, replay failed: %d\n",
+			__func__, retval);
+
+	vfree(rf->buf);
+	kfree(rf);
+
+	return 0;
+}
+
+static const struct file_operations cyttsp_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_replay_open,
+	.write = cyttsp_replay_write_file,
+	.release = cyttsp_replay_release,
+	.llseek = no_llseek,
+};
+
+static int cyttsp_replay_show(struct seq_file *m, void *v)
+{
+	struct cyttsp *ts = m->private;
+	const struct cyttsp_replay_stats *st = &ts->replay;
+
+	seq_printf(m, "result: %d\n", st->result);
+	seq_printf(m, "frames: %u\n", st->frames);
+	seq_printf(m, "syncs: %u\n", st->syncs);
+	seq_printf(m, "events: %u\n", st->events);
+	seq_printf(m, "errors: %u\n", st->errors);
+	seq_printf(m, "dropped: %u\n", st->dropped);
+	seq_printf(m, "total_ns: %llu\n", st->total_ns);
+	seq_printf(m, "max_ns: %llu\n", st->max_ns);
+	seq_printf(m, "ns_per_frame: %llu\n",
+		   st->frames ? div_u64(st->total_ns, st->frames) : 0);
+
+	return 0;
+}
+
+static int cyttsp_replay_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cyttsp_replay_show, inode->i_private);
+}
+
+static const struct file_operations cyttsp_replay_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_replay_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void cyttsp_trace_init(struct cyttsp *ts)
+{
+	mutex_init(&ts->trace_lock);
+
+	if (!ts->dbg_dir)
+		return;
+
+#ifdef CY_USE_TRACE
+	init_waitqueue_head(&ts->trace_wait);
+	if (kfifo_alloc(&ts->trace_fifo, CY_TRACE_FIFO_SIZE, GFP_KERNEL)) {
+		dev_dbg(ts->dev, "%s: Error, failed to allocate trace\n",
+			__func__);
+		return;
+	}
+
+	debugfs_create_file("trace", S_IRUSR, ts->dbg_dir, ts,
+			    &cyttsp_trace_fops);
+#endif
+	debugfs_create_file("replay", S_IWUSR, ts->dbg_dir, ts,
+			    &cyttsp_replay_fops);
+	debugfs_create_file("replay_stats", S_IRUGO, ts->dbg_dir, ts,
+			    &cyttsp_replay_stats_fops);
+}
+
+/* after the debugfs files are gone and the frame readers have stopped */
+static void cyttsp_trace_exit(struct cyttsp *ts)
+{
+#ifdef CY_USE_TRACE
+	kfifo_free(&ts->trace_fifo);
+#endif
+}
+#else
+static inline void cyttsp_trace_init(struct cyttsp *ts)
+{
+}
+
+static inline void cyttsp_trace_exit(struct cyttsp *ts)
+{
+}
+#endif
+
+/* bytes to read from CY_REG_BASE for a frame with num_tch touches */
+static inline u8 cyttsp_frame_len(struct cyttsp *ts, u8 num_tch)
+{
+	if (ts->platform_data->use_gestures)
+		return max_t(u8, cyttsp_xydata_len[num_tch], CY_GEST_LEN);
+
+	return cyttsp_xydata_len[num_tch];
+}
+
+/*
+ * Size the next read from the touch count of a frame just read. len is
+ * what was actually read of the frame, and what gets traced.
+ */
+static void cyttsp_update_prev_tch(struct cyttsp *ts,
+				   const struct cyttsp_xydata *xy_data, u8 len)
+{
+	u8 num_cur_tch = GET_NUM_TOUCHES(xy_data->tt_stat);
+
+	if (num_cur_tch > CY_MAX_FINGER || GET_BOOTLOADERMODE(xy_data->tt_mode))
+		num_cur_tch = 0;
+
+	ts->prev_tch = num_cur_tch;
+	cyttsp_trace_record(ts, xy_data, len);
+}
+
+static void cyttsp_ring_work(struct work_struct *work)
+{
+	struct cyttsp *ts = container_of(work, struct cyttsp, ring_work);
+	unsigned int head, tail;
+	struct cyttsp_frame *frame;
+
+	tail = ts->ring_tail;
+	for (;;) {
+		head = ACCESS_ONCE(ts->ring_head);
+		if (tail == head)
+			break;
+
+		/* read the frame only after seeing the producer's head */
+		smp_rmb();
+		frame = &ts->ring[tail & (CY_FRAME_RING_SIZE - 1)];
+		if (cyttsp_report_tchdata(ts, &frame->xy_data,
+					  frame->irq_time) < 0) {
+			/* the rest of the ring predates the reset */
+			tail = head;
+			smp_mb();
+			ts->ring_tail = tail;
+			schedule_work(&ts->bl_work);
+			continue;
+		}
+
+		/* finish reading the frame before handing the slot back */
+		smp_mb();
+		ts->ring_tail = ++tail;
+	}
+}
+
+/*
+ * Hand a frame that has been read and acknowledged to the decoder. Without
+ * a ring it is decoded and reported right away. May be called from the
+ * bus controller's interrupt context.
+ */
+static int cyttsp_deliver_frame(struct cyttsp *ts,
+				const struct cyttsp_xydata *xy_data)
+{
+	unsigned int head = ts->ring_head;
+	struct cyttsp_frame *frame;
+
+	/* a replayed frame must not leave work behind for the ring */
+	if (!ts->ring_wq || test_bit(CY_REPLAY, &ts->flags))
+		return cyttsp_report_tchdata(ts, xy_data, ts->irq_time);
+
+	if (head - ACCESS_ONCE(ts->ring_tail) >= CY_FRAME_RING_SIZE) {
+		/* the decoder is behind; drop the newest frame */
+		ts->ring_overruns++;
+		queue_work(ts->ring_wq, &ts->ring_work);
+		return 0;
+	}
+
+	/* do not overwrite the slot before the consumer is done with it */
+	smp_mb();
+	frame = &ts->ring[head & (CY_FRAME_RING_SIZE - 1)];
+	memcpy(&frame->xy_data, xy_data, sizeof(frame->xy_data));
+	frame->irq_time = ts->irq_time;
+
+	/* publish the frame contents before the new head */
+	smp_wmb();
+	ts->ring_head = head + 1;
+
+	queue_work(ts->ring_wq, &ts->ring_work);
+
+	return 0;
+}
+
+/*
+ * Count a frame that could not be read or released. A few in a row mean
+ * the part has stopped answering, and the caller is told to recover it.
+ */
+static int cyttsp_frame_lost(struct cyttsp *ts)
+{
+	ts->err.frames++;
+	if (++ts->err_frames < CY_ERR_FRAME_MAX)
+		return 0;
+
+	ts->err_frames = 0;
+	return -EIO;
+}
+
+static int cyttsp_handle_tchdata(struct cyttsp *ts)
+{
+	struct cyttsp_xydata *xy_data = ts->xy_data;
+	u8 num_cur_tch;
+	u8 rd_len;
+	u8 ack = 0;
+	bool batched;
+	int retval;
+	ktime_t t_start, t_end;
+
+	/*
+	 * Get touch data from CYTTSP device. Only the records needed for
+	 * the previous frame's touch count are read; the rest is fetched
+	 * below if more fingers went down since then.
+	 */
+	rd_len = cyttsp_frame_len(ts, ts->prev_tch);
+
+	/*
+	 * The handshake can ride along with the read once we know which
+	 * host mode value the controller expects back. It releases the
+	 * frame, so the read has to cover every touch the frame may carry;
+	 * that is only done while it costs less than a second transaction.
+	 */
+	batched = ts->platform_data->use_hndshk && ts->bus_ops->read_ack &&
+		  ts->hst_cmd_valid &&
+		  cyttsp_frame_len(ts, CY_MAX_FINGER) - rd_len <=
+		  ts->bus_ops->read_ack_slack;
+	if (batched)
+		rd_len = cyttsp_frame_len(ts, CY_MAX_FINGER);
+
+	t_start = ktime_get();
+	if (batched) {
+		ack = ts->hst_cmd ^ CY_HNDSHK_BIT;
+		retval = ttsp_read_block_data_ack(ts, CY_REG_BASE, rd_len,
+						  xy_data, ack);
+	} else
+		retval = ttsp_read_frame_data(ts, CY_REG_BASE, rd_len,
+					      xy_data);
+	if (retval)
+		return cyttsp_frame_lost(ts);
+
+	num_cur_tch = GET_NUM_TOUCHES(xy_data->tt_stat);
+
+	if (batched) {
+		t_end = ktime_get();
+		cyttsp_lat_record(ts, CY_LAT_BUS_READ, t_start, t_end);
+
+		if (xy_data->hst_mode != ts->hst_cmd) {
+			/* out of sync, e.g. after a reset; ack the real value */
+			if (cyttsp_hndshk(ts, xy_data->hst_mode))
+				return cyttsp_frame_lost(ts);
+		} else
+			ts->hst_cmd = ack;
+
+		ts->err_frames = 0;
+		cyttsp_update_prev_tch(ts, xy_data, rd_len);
+
+		return cyttsp_deliver_frame(ts, xy_data);
+	}
+
+	/*
+	 * Fetch the touch records that did not fit in the first read. This
+	 * must happen before the handshake releases the frame buffer.
+	 */
+	if (num_cur_tch <= CY_MAX_FINGER &&
+	    cyttsp_frame_len(ts, num_cur_tch) > rd_len) {
+		if (ttsp_read_frame_data(ts, CY_REG_BASE + rd_len,
+				cyttsp_frame_len(ts, num_cur_tch) - rd_len,
+				(u8 *)xy_data + rd_len))
+			return cyttsp_frame_lost(ts);
+		rd_len = cyttsp_frame_len(ts, num_cur_tch);
+	}
+
+	t_end = ktime_get();
+	cyttsp_lat_record(ts, CY_LAT_BUS_READ, t_start, t_end);
+
+	/* provide flow control handshake */
+	if (ts->platform_data->use_hndshk) {
+		if (cyttsp_hndshk(ts, xy_data->hst_mode))
+			return cyttsp_frame_lost(ts);
+		cyttsp_lat_record(ts, CY_LAT_HNDSHK, t_end, ktime_get());
+	}
+
+	ts->err_frames = 0;
+	cyttsp_update_prev_tch(ts, xy_data, rd_len);
+
+	return cyttsp_deliver_frame(ts, xy_data);
+}
+
+/*
+ * Completion of an asynchronous touch read. This may be called from the
+ * bus controller's interrupt context, so nothing here is allowed to sleep.
+ */
+static void cyttsp_async_done(void *context, int status)
+{
+	struct cyttsp *ts = context;
+	u8 num_cur_tch;
+	u8 rd_len;
+
+	if (status)
+		goto lost;
+
+	num_cur_tch = GET_NUM_TOUCHES(ts->xy_data->tt_stat);
+	if (num_cur_tch <= CY_MAX_FINGER &&
+	    cyttsp_frame_len(ts, num_cur_tch) > ts->async_len) {
+		rd_len = ts->async_len;
+		ts->async_len = cyttsp_frame_len(ts, num_cur_tch);
+		status = ts->bus_ops->read_async(ts->bus_ops,
+						 CY_REG_BASE + rd_len,
+						 ts->async_len - rd_len,
+						 (u8 *)ts->xy_data + rd_len,
+						 cyttsp_async_done, ts);
+		if (!status)
+			return;
+		goto lost;
+	}
+
+	cyttsp_lat_record(ts, CY_LAT_BUS_READ, ts->async_start, ktime_get());
+
+	ts->err_frames = 0;
+	cyttsp_update_prev_tch(ts, ts->xy_data, ts->async_len);
+
+	if (cyttsp_deliver_frame(ts, ts->xy_data) < 0)
+		schedule_work(&ts->bl_work);
+	goto done;
+
+lost:
+	if (cyttsp_frame_lost(ts) < 0)
+		schedule_work(&ts->bl_work);
+done:
+	smp_mb__before_clear_bit();
+	clear_bit(CY_ASYNC_BUSY, &ts->flags);
+}
+
+/*
+ * Queue the touch read without waiting for the bus. Returns 0 when the
+ * frame has been taken care of, or a negative error if the caller has to
+ * fall back to the synchronous path.
+ */
+static int cyttsp_handle_tchdata_async(struct cyttsp *ts)
+{
+	int retval;
+
+	/* the frame in flight is still being read; this edge is dropped */
+	if (test_and_set_bit(CY_ASYNC_BUSY, &ts->flags))
+		return 0;
+
+	ts->async_len = cyttsp_frame_len(ts, ts->prev_tch);
+	ts->async_start = ktime_get();
+	retval = ts->bus_ops->read_async(ts->bus_ops, CY_REG_BASE,
+					 ts->async_len, ts->xy_data,
+					 cyttsp_async_done, ts);
+	if (retval)
+		clear_bit(CY_ASYNC_BUSY, &ts->flags);
+
+	return retval;
+}
+
+static void cyttsp_bl_work(struct work_struct *work)
+{
+	struct cyttsp *ts = container_of(work, struct cyttsp, bl_work);
+
+	cyttsp_recover(ts);
+}
+
+static irqreturn_t cyttsp_hard_irq(int irq, void *handle)
+{
+	struct cyttsp *ts = handle;
+
+	ts->irq_time = ktime_get();
+
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * One scan in a test mode: read it, release it and publish it in the ring.
+ * Only the irq thread writes the ring, so head needs no lock.
+ */
+static void cyttsp_diag_frame(struct cyttsp *ts)
+{
+	struct cyttsp_diag_ring *ring = ts->diag_ring;
+	struct cyttsp_diag_frame *frame;
+	u32 head;
+
+	if (ttsp_read_block_data(ts, CY_REG_BASE, CY_DIAG_READ_LEN,
+				 ts->diag_buf))
+		return;
+
+	if (ts->platform_data->use_hndshk)
+		cyttsp_hndshk(ts, ts->diag_buf[0]);
+
+	head = ring->head;
+	frame = &ring->frames[head % CY_DIAG_FRAMES];
+	frame->seq = head;
+	frame->len = CY_DIAG_READ_LEN;
+	frame->mode = ts->diag_mode;
+	frame->time_ns = ktime_to_ns(ts->irq_time);
+	memcpy(frame->data, ts->diag_buf, CY_DIAG_READ_LEN);
+
+	/* the frame has to be complete before a reader can see it */
+	smp_wmb();
+	ring->head = head + 1;
+
+	wake_up_interruptible(&ts->diag_wait);
+}
+
+/*
+ * The scheduling class and cpus of the irq thread can only be changed
+ * through its task, so the thread applies them itself on its next run.
+ */
+static void cyttsp_irq_tune(struct cyttsp *ts)
+{
+	struct sched_param param = {
+		.sched_priority = ACCESS_ONCE(ts->irq_prio),
+	};
+
+	clear_bit(CY_IRQ_TUNE, &ts->flags);
+
+	if (!param.sched_priority)
+		param.sched_priority = CY_IRQ_PRIO_DFLT;
+	if (sched_setscheduler(current, SCHED_FIFO, &param))
+		dev_err(ts->dev, "%s: Error, failed to set priority %d\n",
+			__func__, param.sched_priority);
+
+	if (set_cpus_allowed_ptr(current, cpumask_empty(&ts->irq_mask) ?
+				 cpu_all_mask : &ts->irq_mask))
+		dev_err(ts->dev, "%s: Error, failed to set affinity\n",
+			__func__);
+}
+
+/* point the hard irq at the same cpus; irqbalance honours the hint */
+static void cyttsp_irq_hint(struct cyttsp *ts)
+{
+	if (ts->irq_requested)
+		irq_set_affinity_hint(ts->irq, cpumask_empty(&ts->irq_mask) ?
+				      NULL : &ts->irq_mask);
+}
+
+static void cyttsp_free_irq(struct cyttsp *ts)
+{
+	if (ts->irq_requested) {
+		irq_set_affinity_hint(ts->irq, NULL);
+		free_irq(ts->irq, ts);
+		ts->irq_requested = false;
+	}
+}
+
+static irqreturn_t cyttsp_irq(int irq, void *handle)
+{
+	struct cyttsp *ts = handle;
+	enum cyttsp_powerstate state;
+	int retval;
+
+	if (unlikely(test_bit(CY_IRQ_TUNE, &ts->flags)))
+		cyttsp_irq_tune(ts);
+
+	cyttsp_lat_record(ts, CY_LAT_IRQ_WAKE, ts->irq_time, ktime_get());
+
+	state = cyttsp_get_state(ts);
+	if (!cyttsp_touch_state(state) ||
+	    test_bit(CY_MODE_WAIT, &ts->flags) ||
+	    test_bit(CY_RECONFIG, &ts->flags))
+		complete(&ts->bl_ready);
+	else if (test_bit(CY_DIAG, &ts->flags))
+		cyttsp_diag_frame(ts);
+	else {
+		/* a touch restarts the autosuspend delay, or ends low power */
+		pm_runtime_mark_last_busy(ts->dev);
+		if (state == CY_LOW_PWR_STATE)
+			pm_request_resume(ts->dev);
+
+		/*
+		 * The handshake is a sleeping write, so the asynchronous
+		 * read can only be used when flow control is off.
+		 */
+		if (ts->bus_ops->read_async && !ts->platform_data->use_hndshk &&
+		    !cyttsp_handle_tchdata_async(ts))
+			return IRQ_HANDLED;
+
+		/* process the touches; recovery must not hold up this thread */
+		retval = cyttsp_handle_tchdata(ts);
+
+		if (retval < 0)
+			schedule_work(&ts->bl_work);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static int cyttsp_diag_ready(struct cyttsp *ts)
+{
+	u8 *hst_mode = &ts->mode_data.hst_mode;
+	int retval;
+
+	retval = ttsp_read_block_data(ts, CY_REG_BASE, sizeof(*hst_mode),
+				      hst_mode);
+	if (retval)
+		return retval;
+
+	return GET_HSTMODE(*hst_mode) != GET_HSTMODE(ts->diag_mode) ?
+		-EAGAIN : 0;
+}
+
+/*
+ * Switch between operational mode and one of the test modes. Touches are
+ * not reported while a test mode is on. Called with gov.lock held.
+ */
+static int cyttsp_diag_set(struct cyttsp *ts, u8 mode)
+{
+	int retval;
+
+	if (mode == ts->diag_mode)
+		return 0;
+
+	if (cyttsp_get_state(ts) != CY_ACTIVE_STATE || !ts->irq_requested) {
+		if (mode)
+			return -EAGAIN;
+		/* the next power up starts in operational mode anyway */
+		clear_bit(CY_DIAG, &ts->flags);
+		ts->diag_mode = 0;
+		return 0;
+	}
+
+	/* no touch or test frame may be in flight across the switch */
+	clear_bit(CY_DIAG, &ts->flags);
+	cyttsp_reconfig_begin(ts);
+
+	if (!mode) {
+		ts->diag_mode = 0;
+		retval = cyttsp_set_operational_mode(ts);
+		if (!retval && ts->cfg.act_dist != CY_ACT_DIST_DFLT)
+			retval = cyttsp_act_dist_setup(ts);
+		goto exit;
+	}
+
+	ts->diag_mode = mode;
+	ts->diag_ring->mode = mode;
+	cyttsp_wait_mode_begin(ts);
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(mode), &mode);
+	if (retval < 0)
+		clear_bit(CY_MODE_WAIT, &ts->flags);
+	else
+		retval = cyttsp_wait_mode(ts, cyttsp_diag_ready);
+
+	if (retval < 0) {
+		ts->diag_mode = 0;
+		cyttsp_set_operational_mode(ts);
+		goto exit;
+	}
+
+	set_bit(CY_DIAG, &ts->flags);
+
+exit:
+	cyttsp_reconfig_end(ts);
+	if (retval < 0)
+		dev_err(ts->dev, "%s: Error, failed to set mode %02X: %d\n",
+			__func__, mode, retval);
+
+	return retval;
+}
+
+static void cyttsp_diag_stop(struct cyttsp *ts)
+{
+	mutex_lock(&ts->gov.lock);
+	cyttsp_diag_set(ts, 0);
+	mutex_unlock(&ts->gov.lock);
+}
+
+static int cyttsp_diag_open(struct inode *inode, struct file *file)
+{
+	struct cyttsp *ts = container_of(file->private_data,
+					 struct cyttsp, diag_misc);
+
+	file->private_data = ts;
+
+	return nonseekable_open(inode, file);
+}
+
+static int cyttsp_diag_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct cyttsp *ts = file->private_data;
+
+	return remap_vmalloc_range(vma, ts->diag_ring, vma->vm_pgoff);
+}
+
+static unsigned int cyttsp_diag_poll(struct file *file, poll_table *wait)
+{
+	struct cyttsp *ts = file->private_data;
+	struct cyttsp_diag_ring *ring = ts->diag_ring;
+
+	poll_wait(file, &ts->diag_wait, wait);
+
+	return ACCESS_ONCE(ring->head) != ACCESS_ONCE(ring->tail) ?
+		POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations cyttsp_diag_fops = {
+	.owner = THIS_MODULE,
+	.open = cyttsp_diag_open,
+	.mmap = cyttsp_diag_mmap,
+	.poll = cyttsp_diag_poll,
+	.llseek = no_llseek,
+};
+
+static int cyttsp_diag_init(struct cyttsp *ts)
+{
+	int retval;
+
+	init_waitqueue_head(&ts->diag_wait);
+
+	ts->diag_buf = kmalloc(L1_CACHE_ALIGN(CY_DIAG_READ_LEN), GFP_KERNEL);
+	if (!ts->diag_buf)
+		return -ENOMEM;
+
+	ts->diag_size = PAGE_ALIGN(sizeof(*ts->diag_ring) +
+		CY_DIAG_FRAMES * sizeof(struct cyttsp_diag_frame));
+	ts->diag_ring = vmalloc_user(ts->diag_size);
+	if (!ts->diag_ring) {
+		retval = -ENOMEM;
+		goto error_free_buf;
+	}
+	ts->diag_ring->num_frames = CY_DIAG_FRAMES;
+	ts->diag_ring->frame_size = sizeof(struct cyttsp_diag_frame);
+
+	snprintf(ts->diag_name, sizeof(ts->diag_name), "cyttsp_diag-%s",
+		 dev_name(ts->dev));
+	ts->diag_misc.minor = MISC_DYNAMIC_MINOR;
+	ts->diag_misc.name = ts->diag_name;
+	ts->diag_misc.fops = &cyttsp_diag_fops;
+	ts->diag_misc.parent = ts->dev;
+	retval = misc_register(&ts->diag_misc);
+	if (retval)
+		goto error_free_ring;
+	ts->diag_registered = true;
+
+	return 0;
+
+error_free_ring:
+	vfree(ts->diag_ring);
+	ts->diag_ring = NULL;
+error_free_buf:
+	kfree(ts->diag_buf);
+	ts->diag_buf = NULL;
+	return retval;
+}
+
+static void cyttsp_diag_exit(struct cyttsp *ts)
+{
+	if (ts->diag_registered)
+		misc_deregister(&ts->diag_misc);
+	ts->diag_registered = false;
+	vfree(ts->diag_ring);
+	ts->diag_ring = NULL;
+	kfree(ts->diag_buf);
+	ts->diag_buf = NULL;
+}
+
+#ifdef CONFIG_PM
+/*
+ * Move an operational controller between its power modes:
+ *
+ *   ACTIVE  <-> LOW_PWR   host mode CY_LOW_POWER_MODE; the part keeps
+ *                         scanning at lp_intrvl and still reports touches
+ *   ACTIVE  <-> SLEEP     host mode CY_DEEP_SLEEP_MODE; the part only comes
+ *   LOW_PWR  -> SLEEP     back through platform_data->wakeup()
+ *
+ * Leaving SLEEP is done by cyttsp_resume(), since it may find the part
+ * back in its bootloader.
+ */
+static int cyttsp_set_power_mode(struct cyttsp *ts,
+				 enum cyttsp_powerstate state)
+{
+	enum cyttsp_powerstate old = cyttsp_get_state(ts);
+	u8 mode;
+	int retval;
+
+	switch (state) {
+	case CY_ACTIVE_STATE:
+		if (old != CY_LOW_PWR_STATE)
+			return -EINVAL;
+		mode = CY_OPERATE_MODE;
+		break;
+	case CY_LOW_PWR_STATE:
+		if (old != CY_ACTIVE_STATE)
+			return -EINVAL;
+		mode = CY_LOW_POWER_MODE;
+		break;
+	case CY_SLEEP_STATE:
+		if (!cyttsp_touch_state(old))
+			return -EINVAL;
+		mode = CY_DEEP_SLEEP_MODE;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/*
+	 * Touches keep coming in low power, so only sleep has to close the
+	 * touch path before the part goes quiet.
+	 */
+	if (state == CY_SLEEP_STATE) {
+		cyttsp_set_state(ts, CY_SLEEP_STATE);
+		cyttsp_quiesce(ts);
+		cyttsp_release_contacts(ts, ktime_get());
+	} else
+		/* or its handshake would write the old mode back */
+		cyttsp_reconfig_begin(ts);
+
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(mode), &mode);
+	if (retval < 0)
+		cyttsp_set_state(ts, old);
+	else
+		cyttsp_set_state(ts, state);
+
+	if (state != CY_SLEEP_STATE)
+		cyttsp_reconfig_end(ts);
+	if (retval < 0)
+		return retval;
+
+	cyttsp_pr_state(ts);
+
+	return 0;
+}
+#endif
+
+static int cyttsp_power_on(struct cyttsp *ts)
+{
+	int retval = 0;
+
+	if (!ts)
+		return -ENOMEM;
+
+	/* no controller behind it; frames only come from a replay */
+	if (!ts->irq) {
+		cyttsp_set_state(ts, CY_ACTIVE_STATE);
+		return 0;
+	}
+
+	cyttsp_set_state(ts, CY_BL_STATE);
+
+	/*
+	 * enable interrupts; the hard handler only takes the timestamp, so
+	 * it stays in hard irq context even where handlers are force threaded
+	 */
+	set_bit(CY_IRQ_TUNE, &ts->flags);
+	retval = request_threaded_irq(ts->irq, cyttsp_hard_irq, cyttsp_irq,
+		IRQF_TRIGGER_FALLING | IRQF_ONESHOT | CY_IRQF_NO_THREAD,
+		ts->platform_data->name, ts);
+	if (retval < 0)
+		goto bypass;
+	ts->irq_requested = true;
+	cyttsp_irq_hint(ts);
+
+	/* the irq is not shared; give it back so a later try can have it */
+	retval = cyttsp_soft_reset(ts);
+	if (retval <= 0) {
+		if (!retval)
+			retval = -ETIMEDOUT;
+		goto error_free_irq;
+	}
+
+	retval = cyttsp_bl_app_valid(ts);
+	if (retval < 0)
+		goto error_free_irq;
+	else if (retval > 0)
+		goto no_bl_bypass;
+
+	retval = cyttsp_exit_bl_mode(ts);
+
+	if (retval < 0)
+		goto error_free_irq;
+
+	cyttsp_set_state(ts, CY_IDLE_STATE);
+
+no_bl_bypass:
+	retval = cyttsp_apply_config(ts, true);
+	if (retval < 0)
+		goto error_free_irq;
+
+	cyttsp_set_state(ts, CY_ACTIVE_STATE);
+	retval = 0;
+	goto bypass;
+
+error_free_irq:
+	cyttsp_free_irq(ts);
+bypass:
+	cyttsp_pr_state(ts);
+	return retval;
+}
+
+#ifdef CONFIG_PM
+int cyttsp_resume(void *handle)
+{
+	struct cyttsp *ts = handle;
+	int retval = 0;
+	struct cyttsp_xydata *xy_data;
+
+	if (!ts)
+		return retval;
+
+	xy_data = ts->xy_data;
+
+	if (ts->platform_data->use_sleep &&
+	    cyttsp_get_state(ts) == CY_SLEEP_STATE) {
+
+		if (ts->platform_data->wakeup)
+			retval = ts->platform_data->wakeup();
+		else
+			retval = -ENOSYS;
+
+		/*
+		 * The host mode and the mode/status byte that follows it are
+		 * enough to tell an awake controller from one that has gone
+		 * back to its bootloader.
+		 */
+		if (retval >= 0) {
+			retval = ttsp_read_block_data(ts, CY_REG_BASE,
+				offsetof(struct cyttsp_xydata, tt_stat),
+				xy_data);
+			if (retval < 0)
+				return retval;
+
+			if (GET_BOOTLOADERMODE(xy_data->tt_mode))
+				retval = cyttsp_restart_from_bl(ts);
+			else if (!GET_HSTMODE(xy_data->hst_mode))
+				cyttsp_set_state(ts, CY_ACTIVE_STATE);
+		}
+
+		/* nobody has the device open; park it in low power again */
+		if (retval >= 0 && pm_runtime_suspended(ts->dev))
+			retval = cyttsp_set_power_mode(ts, CY_LOW_PWR_STATE);
+	}
+
+	return retval;
+}
+EXPORT_SYMBOL_GPL(cyttsp_resume);
+
+int cyttsp_suspend(void *handle)
+{
+	struct cyttsp *ts = handle;
+	int retval = 0;
+
+	cyttsp_diag_stop(ts);
+
+	/* no interval change or recovery may be half done when it sleeps */
+	cancel_work_sync(&ts->bl_work);
+	mutex_lock(&ts->gov.lock);
+	if (ts->platform_data->use_sleep &&
+	    cyttsp_touch_state(cyttsp_get_state(ts)))
+		retval = cyttsp_set_power_mode(ts, CY_SLEEP_STATE);
+	mutex_unlock(&ts->gov.lock);
+
+	return retval;
+}
+EXPORT_SYMBOL_GPL(cyttsp_suspend);
+#endif
+
+#ifdef CONFIG_PM_RUNTIME
+/*
+ * Runtime PM follows touch activity. Every touch interrupt marks the device
+ * busy, and once autosuspend_delay_ms (idle_ms at probe) passes without
+ * one the controller drops to scanning at lp_intrvl. A touch in low power
+ * resumes it from the irq thread, without a reset. Closing the input
+ * device parks it in low power right away; a device started synchronously
+ * also loses its irq then, and the next open powers it on from scratch.
+ *
+ * Both run under gov.lock, so that they cannot overlap an interval
+ * change, a recovery or a diag mode switch.
+ */
+int cyttsp_runtime_suspend(void *handle)
+{
+	struct cyttsp *ts = handle;
+	int retval = 0;
+
+	mutex_lock(&ts->gov.lock);
+	/* test modes have to be left from operational mode */
+	if (ts->diag_mode)
+		retval = -EBUSY;
+	else if (cyttsp_get_state(ts) == CY_ACTIVE_STATE)
+		retval = cyttsp_set_power_mode(ts, CY_LOW_PWR_STATE);
+	mutex_unlock(&ts->gov.lock);
+
+	return retval;
+}
+EXPORT_SYMBOL_GPL(cyttsp_runtime_suspend);
+
+int cyttsp_runtime_resume(void *handle)
+{
+	struct cyttsp *ts = handle;
+	int retval = 0;
+
+	mutex_lock(&ts->gov.lock);
+	if (cyttsp_get_state(ts) == CY_LOW_PWR_STATE)
+		retval = cyttsp_set_power_mode(ts, CY_ACTIVE_STATE);
+	mutex_unlock(&ts->gov.lock);
+
+	return retval;
+}
+EXPORT_SYMBOL_GPL(cyttsp_runtime_resume);
+#endif
+
+/*
+ * Once the irq is freed, the last asynchronous read and the frames left in
+ * the decoder ring can still queue a recovery, so that is cancelled last.
+ */
+static void cyttsp_drain(struct cyttsp *ts)
+{
+	while (test_bit(CY_ASYNC_BUSY, &ts->flags))
+		msleep(1);
+	if (ts->ring_wq)
+		flush_workqueue(ts->ring_wq);
+	cancel_work_sync(&ts->bl_work);
+}
+
+static void cyttsp_startup_work(struct work_struct *work)
+{
+	struct cyttsp *ts = container_of(work, struct cyttsp, startup_work);
+
+	ts->startup_ret = cyttsp_power_on(ts);
+	complete_all(&ts->startup_done);
+}
+
+/*
+ * Poll the bootloader until it is idle and, for block writes, still in
+ * its bootload session. There is no interrupt to wait for while flashing.
+ */
+static int cyttsp_bl_wait(struct cyttsp *ts, bool in_session,
+			  unsigned int timeout_ms)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(timeout_ms);
+	unsigned int delay = CY_DELAY_MIN;
+	int retval;
+
+	for (;;) {
+		retval = cyttsp_load_bl_regs(ts);
+		if (!retval && IS_BL_READY(ts->bl_data.bl_status) &&
+		    (!in_session ||
+		     ts->bl_data.bl_error == CY_BL_BOOTLOADING))
+			return 0;
+
+		if (time_after(jiffies, timeout))
+			return retval ? retval : -ETIMEDOUT;
+
+		msleep(delay);
+		delay = min_t(unsigned int, delay << 1, CY_DELAY_DFLT);
+	}
+}
+
+static int cyttsp_bl_reset(struct cyttsp *ts)
+{
+	u8 cmd = CY_SOFT_RESET_MODE;
+	int retval;
+
+	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
+	if (retval < 0)
+		return retval;
+
+	return cyttsp_bl_wait(ts, false, CY_DELAY_DFLT * CY_DELAY_MAX);
+}
+
+/* write one bootloader command; the bus driver splits it as needed */
+static int cyttsp_fw_write_record(struct cyttsp *ts, u8 *rec, size_t len)
+{
+	if (ts->platform_data->bl_keys && len >= CY_BL_KEYS_OFFS +
+	    CY_NUM_BL_KEYS)
+		memcpy(&rec[CY_BL_KEYS_OFFS], ts->platform_data->bl_keys,
+		       CY_NUM_BL_KEYS);
+
+	return ttsp_write_block_data(ts, CY_REG_BASE, len, rec);
+}
+
+static int cyttsp_fw_check(struct cyttsp *ts, const struct firmware *fw)
+{
+	const struct cyttsp_fw_header *hdr = (const void *)fw->data;
+	size_t pos = sizeof(*hdr);
+	unsigned int i, len;
+
+	if (fw->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, CY_FW_MAGIC, sizeof(hdr->magic)))
+		return -EINVAL;
+
+	for (i = 0; i < be16_to_cpu(hdr->num_records); i++) {
+		if (pos + 2 > fw->size)
+			return -EINVAL;
+		len = get_unaligned_be16(&fw->data[pos]);
+		pos += 2;
+		if (len < CY_BL_KEYS_OFFS || pos + len > fw->size ||
+		    len > 0xFF)
+			return -EINVAL;
+		if (i == 0 && fw->data[pos + 2] != CY_BL_INIT_LOAD)
+			return -EINVAL;
+		pos += len;
+	}
+
+	return 0;
+}
+
+static int cyttsp_fw_flash(struct cyttsp *ts, const struct firmware *fw)
+{
+	const struct cyttsp_fw_header *hdr = (const void *)fw->data;
+	size_t pos = sizeof(*hdr);
+	unsigned int i, len;
+	unsigned int timeout;
+	u8 *rec;
+	int retval = 0;
+
+	rec = kmalloc(0xFF, GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+
+	for (i = 0; i < be16_to_cpu(hdr->num_records); i++) {
+		len = get_unaligned_be16(&fw->data[pos]);
+		pos += 2;
+		memcpy(rec, &fw->data[pos], len);
+		pos += len;
+
+		retval = cyttsp_fw_write_record(ts, rec, len);
+		if (retval < 0)
+			break;
+
+		if (rec[2] == CY_BL_WRITE_BLK)
+			timeout = CY_FW_BLK_TMOUT;
+		else
+			timeout = CY_FW_INIT_TMOUT;
+
+		retval = cyttsp_bl_wait(ts, rec[2] == CY_BL_WRITE_BLK, timeout);
+		if (retval < 0) {
+			dev_err(ts->dev, "%s: Error, record %u: status=%02X "
+				"error=%02X\n", __func__, i,
+				ts->bl_data.bl_status, ts->bl_data.bl_error);
+			break;
+		}
+	}
+
+	kfree(rec);
+
 	return retval;
 }
 
-static int cyttsp_set_sysinfo_regs(struct cyttsp *ts)
+static int cyttsp_fw_update(struct cyttsp *ts, const struct firmware *fw)
 {
-	int retval = 0;
+	const struct cyttsp_fw_header *hdr = (const void *)fw->data;
+	bool was_up = ts->irq_requested;
+	int retval;
+
+	/* a running part tells its version without being reset */
+	if (!ts->fw_force && ts->sysinfo_valid &&
+	    ts->sysinfo_data.app_verh == hdr->appver_hi &&
+	    ts->sysinfo_data.app_verl == hdr->appver_lo)
+		return 0;
 
-	if (ts->platform_data->act_intrvl != CY_ACT_INTRVL_DFLT ||
-		ts->platform_data->tch_tmout != CY_TCH_TMOUT_DFLT ||
-		ts->platform_data->lp_intrvl != CY_LP_INTRVL_DFLT) {
+	/*
+	 * the interrupt only gets in the way while the part is written, and
+	 * a read still in flight or a frame left in the ring would land in
+	 * the bootloader. bl_work is not cancelled here, it needs gov.lock;
+	 * a recovery queued meanwhile runs once the part is back up.
+	 */
+	cyttsp_set_state(ts, CY_BL_STATE);
+	cyttsp_free_irq(ts);
+	cyttsp_quiesce(ts);
+
+	retval = cyttsp_bl_reset(ts);
+	if (retval < 0)
+		goto exit;
 
-		u8 intrvl_ray[3];
+	if (!ts->fw_force && IS_VALID_APP(ts->bl_data.bl_status) &&
+	    ts->bl_data.appver_hi == hdr->appver_hi &&
+	    ts->bl_data.appver_lo == hdr->appver_lo)
+		goto exit;
 
-		intrvl_ray[0] = ts->platform_data->act_intrvl;
-		intrvl_ray[1] = ts->platform_data->tch_tmout;
-		intrvl_ray[2] = ts->platform_data->lp_intrvl;
+	dev_info(ts->dev, "%s: flashing application %02X%02X over %02X%02X\n",
+		 __func__, hdr->appver_hi, hdr->appver_lo,
+		 ts->bl_data.appver_hi, ts->bl_data.appver_lo);
 
-		/* set intrvl registers */
-		retval = ttsp_write_block_data(ts,
-				CY_REG_ACT_INTRVL,
-				sizeof(intrvl_ray), intrvl_ray);
+	ts->sysinfo_valid = false;
+	retval = cyttsp_fw_flash(ts, fw);
+	if (retval < 0)
+		goto exit;
+
+	retval = cyttsp_bl_reset(ts);
+	if (retval < 0)
+		goto exit;
 
-		msleep(CY_DELAY_DFLT);
+	if (!(ts->bl_data.bl_status & CY_BL_CHKSUM_OK)) {
+		dev_err(ts->dev, "%s: Error, bad checksum after update\n",
+			__func__);
+		retval = -EIO;
+	}
+
+exit:
+	/* bring a part that was in use back up, new firmware or not */
+	if (was_up) {
+		int ret = cyttsp_power_on(ts);
+
+		if (!retval)
+			retval = ret;
+		if (ts->platform_data->use_async_init)
+			ts->startup_ret = ret;
 	}
+	cyttsp_pr_state(ts);
 
 	return retval;
 }
 
-static int cyttsp_soft_reset(struct cyttsp *ts)
+static void cyttsp_fw_loaded(const struct firmware *fw, void *context)
 {
+	struct cyttsp *ts = context;
 	int retval;
-	u8 cmd = CY_SOFT_RESET_MODE;
-	long wait_jiffies = msecs_to_jiffies(CY_DELAY_DFLT * CY_DELAY_MAX);
-	/* wait for interrupt to set ready completion */
-	INIT_COMPLETION(ts->bl_ready);
 
-	retval = ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), &cmd);
+	if (!fw) {
+		dev_dbg(ts->dev, "%s: no firmware %s\n", __func__,
+			ts->platform_data->fw_name);
+		goto done;
+	}
+
+	retval = cyttsp_fw_check(ts, fw);
+	if (retval < 0) {
+		dev_err(ts->dev, "%s: Error, bad firmware image %s\n",
+			__func__, ts->platform_data->fw_name);
+		goto release;
+	}
+
+	if (ts->platform_data->use_async_init)
+		wait_for_completion(&ts->startup_done);
+
+	/* keep open/close and the governor off the part meanwhile */
+	mutex_lock(&ts->input->mutex);
+	mutex_lock(&ts->gov.lock);
+	retval = cyttsp_fw_update(ts, fw);
+	mutex_unlock(&ts->gov.lock);
+	mutex_unlock(&ts->input->mutex);
+
 	if (retval < 0)
-		return retval;
+		dev_err(ts->dev, "%s: Error, firmware update failed: %d\n",
+			__func__, retval);
 
-	return wait_for_completion_timeout(&ts->bl_ready, wait_jiffies);
+release:
+	release_firmware(fw);
+done:
+	complete(&ts->fw_done);
+	smp_mb__before_clear_bit();
+	clear_bit(CY_FW_BUSY, &ts->flags);
 }
 
-static int cyttsp_act_dist_setup(struct cyttsp *ts)
+static int cyttsp_fw_request(struct cyttsp *ts, bool force)
 {
 	int retval;
-	u8 act_dist_setup;
 
-	/* Init gesture; active distance setup */
-	act_dist_setup = ts->platform_data->act_dist;
-	retval = ttsp_write_block_data(ts, CY_REG_ACT_DIST,
-		sizeof(act_dist_setup), &act_dist_setup);
+	if (!ts->platform_data->fw_name)
+		return -ENOENT;
+
+	if (test_and_set_bit(CY_FW_BUSY, &ts->flags))
+		return -EBUSY;
+
+	ts->fw_force = force;
+	INIT_COMPLETION(ts->fw_done);
+	retval = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG,
+					 ts->platform_data->fw_name, ts->dev,
+					 GFP_KERNEL, ts, cyttsp_fw_loaded);
+	if (retval) {
+		complete(&ts->fw_done);
+		clear_bit(CY_FW_BUSY, &ts->flags);
+	}
 
 	return retval;
 }
 
-static int cyttsp_hndshk(struct cyttsp *ts, u8 hst_mode)
+static ssize_t cyttsp_intrvl_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
 {
-	u8 cmd;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
 
-	cmd = hst_mode ^ CY_HNDSHK_BIT;
+	return sprintf(buf, "%u %u %u\n", ts->hw_intrvl[0], ts->hw_intrvl[1],
+		       ts->hw_intrvl[2]);
+}
 
-	return ttsp_write_block_data(ts, CY_REG_BASE, sizeof(cmd), (u8 *)&cmd);
+static DEVICE_ATTR(intrvl, S_IRUGO, cyttsp_intrvl_show, NULL);
+
+#define CYTTSP_GOV_SHOW(_name)						\
+static ssize_t cyttsp_gov_##_name##_show(struct device *dev,		\
+					 struct device_attribute *attr,	\
+					 char *buf)			\
+{									\
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));	\
+									\
+	return sprintf(buf, "%u\n", (unsigned int)ts->gov._name);	\
 }
 
-static void cyttsp_report_slot(struct input_dev *dev, int slot,
-			       int x, int y, int z)
+#define CYTTSP_GOV_ATTR(_name, _max)					\
+CYTTSP_GOV_SHOW(_name)							\
+									\
+static ssize_t cyttsp_gov_##_name##_store(struct device *dev,		\
+					  struct device_attribute *attr,\
+					  const char *buf, size_t count)\
+{									\
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));	\
+	unsigned long val;						\
+									\
+	if (strict_strtoul(buf, 10, &val) || val > (_max))		\
+		return -EINVAL;						\
+									\
+	mutex_lock(&ts->gov.lock);					\
+	ts->gov._name = val;						\
+	mutex_unlock(&ts->gov.lock);					\
+	schedule_work(&ts->gov.work);					\
+									\
+	return count;							\
+}									\
+									\
+static DEVICE_ATTR(gov_##_name, S_IRUGO | S_IWUSR,			\
+		   cyttsp_gov_##_name##_show, cyttsp_gov_##_name##_store)
+
+CYTTSP_GOV_ATTR(enable, 1);
+CYTTSP_GOV_ATTR(fast_intrvl, 0xFF);
+CYTTSP_GOV_ATTR(speed, INT_MAX);
+CYTTSP_GOV_ATTR(hold_ms, 60000);
+
+/* once set here, a panel profile picked later no longer overrides it */
+CYTTSP_GOV_SHOW(idle_tmout)
+
+static ssize_t cyttsp_gov_idle_tmout_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
 {
-	input_mt_slot(dev, slot);
-	input_mt_report_slot_state(dev, MT_TOOL_FINGER, true);
-	input_report_abs(dev, ABS_MT_POSITION_X, x);
-	input_report_abs(dev, ABS_MT_POSITION_Y, y);
-	input_report_abs(dev, ABS_MT_TOUCH_MAJOR, z);
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	unsigned long val;
+
+	if (strict_strtoul(buf, 10, &val) || val > 0xFF)
+		return -EINVAL;
+
+	mutex_lock(&ts->gov.lock);
+	ts->gov.idle_tmout = val;
+	ts->gov.idle_tmout_set = true;
+	mutex_unlock(&ts->gov.lock);
+	schedule_work(&ts->gov.work);
+
+	return count;
 }
 
-static void cyttsp_report_slot_empty(struct input_dev *dev, int slot)
+static DEVICE_ATTR(gov_idle_tmout, S_IRUGO | S_IWUSR,
+		   cyttsp_gov_idle_tmout_show, cyttsp_gov_idle_tmout_store);
+
+static ssize_t cyttsp_jitter_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
 {
-	input_mt_slot(dev, slot);
-	input_mt_report_slot_state(dev, MT_TOOL_FINGER, false);
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+
+	return sprintf(buf, "%d\n", ts->jitter);
 }
 
-static void cyttsp_extract_track_ids(struct cyttsp_xydata *xy_data, int *ids)
+static ssize_t cyttsp_jitter_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
 {
-	ids[0] = xy_data->touch12_id >> 4;
-	ids[1] = xy_data->touch12_id & 0xF;
-	ids[2] = xy_data->touch34_id >> 4;
-	ids[3] = xy_data->touch34_id & 0xF;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	long val;
+
+	if (strict_strtol(buf, 10, &val) || val < -1 || val > 0xFF)
+		return -EINVAL;
+
+	ts->jitter = val;
+
+	return count;
 }
 
-static const struct cyttsp_tch *cyttsp_get_tch(struct cyttsp_xydata *xy_data,
-					       int idx)
+static DEVICE_ATTR(jitter, S_IRUGO | S_IWUSR,
+		   cyttsp_jitter_show, cyttsp_jitter_store);
+
+static ssize_t cyttsp_irq_prio_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
 {
-	switch (idx) {
-	case 0:
-		return &xy_data->tch1;
-	case 1:
-		return &xy_data->tch2;
-	case 2:
-		return &xy_data->tch3;
-	case 3:
-		return  &xy_data->tch4;
-	default:
-		return NULL;
-	}
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+
+	return sprintf(buf, "%d\n", ts->irq_prio);
 }
 
-static int cyttsp_handle_tchdata(struct cyttsp *ts)
+static ssize_t cyttsp_irq_prio_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
 {
-	struct cyttsp_xydata xy_data;
-	u8 num_cur_tch;
-	int i;
-	int ids[4];
-	const struct cyttsp_tch *tch = NULL;
-	int x, y, z;
-	int used = 0;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	unsigned long val;
 
-	/* Get touch data from CYTTSP device */
-	if (ttsp_read_block_data(ts,
-		CY_REG_BASE, sizeof(struct cyttsp_xydata), &xy_data))
-		return 0;
+	if (strict_strtoul(buf, 10, &val) || val >= MAX_USER_RT_PRIO)
+		return -EINVAL;
 
-	/* provide flow control handshake */
-	if (ts->platform_data->use_hndshk)
-		if (cyttsp_hndshk(ts, xy_data.hst_mode))
-			return 0;
+	ts->irq_prio = val;
+	set_bit(CY_IRQ_TUNE, &ts->flags);
 
-	/* determine number of currently active touches */
-	num_cur_tch = GET_NUM_TOUCHES(xy_data.tt_stat);
+	return count;
+}
 
-	/* check for any error conditions */
-	if (ts->power_state == CY_IDLE_STATE)
-		return 0;
-	else if (GET_BOOTLOADERMODE(xy_data.tt_mode)) {
-		return -1;
-	} else if (IS_LARGE_AREA(xy_data.tt_stat) == 1) {
-		/* terminate all active tracks */
-		num_cur_tch = 0;
-		dev_dbg(ts->dev, "%s: Large area detected\n", __func__);
-	} else if (num_cur_tch > CY_MAX_FINGER) {
-		/* terminate all active tracks */
-		num_cur_tch = 0;
-		dev_dbg(ts->dev, "%s: Num touch error detected\n", __func__);
-	} else if (IS_BAD_PKT(xy_data.tt_mode)) {
-		/* terminate all active tracks */
-		num_cur_tch = 0;
-		dev_dbg(ts->dev, "%s: Invalid buffer detected\n", __func__);
-	}
+static DEVICE_ATTR(irq_prio, S_IRUGO | S_IWUSR,
+		   cyttsp_irq_prio_show, cyttsp_irq_prio_store);
 
-	cyttsp_extract_track_ids(&xy_data, ids);
+static ssize_t cyttsp_irq_cpus_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	int len;
 
-	for (i = 0; i < num_cur_tch; i++) {
-		used |= (1 << ids[i]);
+	len = cpumask_scnprintf(buf, PAGE_SIZE - 1, &ts->irq_mask);
+	buf[len++] = '\n';
 
-		tch = cyttsp_get_tch(&xy_data, i);
+	return len;
+}
 
-		x = be16_to_cpu(tch->x);
-		y = be16_to_cpu(tch->y);
-		z = tch->z;
+/* takes the same hex cpu mask as /proc/irq/N/smp_affinity; 0 for any */
+static ssize_t cyttsp_irq_cpus_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	cpumask_var_t mask;
+	int retval;
 
-		cyttsp_report_slot(ts->input, ids[i], x, y, z);
-	}
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
 
-	for (i = 0; i < CY_MAX_ID; i++)
-		if (!(used & (1 << i)))
-			cyttsp_report_slot_empty(ts->input, i);
+	retval = cpumask_parse_user(buf, count, mask);
+	if (!retval && !cpumask_empty(mask) &&
+	    !cpumask_intersects(mask, cpu_online_mask))
+		retval = -EINVAL;
+
+	if (!retval) {
+		/* a firmware update frees the irq under gov.lock */
+		mutex_lock(&ts->gov.lock);
+		cpumask_copy(&ts->irq_mask, mask);
+		cyttsp_irq_hint(ts);
+		mutex_unlock(&ts->gov.lock);
+		set_bit(CY_IRQ_TUNE, &ts->flags);
+	}
 
-	input_sync(ts->input);
+	free_cpumask_var(mask);
 
-	return 0;
+	return retval ? retval : count;
 }
 
-static void cyttsp_pr_state(struct cyttsp *ts)
+static DEVICE_ATTR(irq_cpus, S_IRUGO | S_IWUSR,
+		   cyttsp_irq_cpus_show, cyttsp_irq_cpus_store);
+
+static ssize_t cyttsp_predict_ms_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
-	static char *cyttsp_powerstate_string[] = {
-		"IDLE",
-		"ACTIVE",
-		"LOW_PWR",
-		"SLEEP",
-		"BOOTLOADER",
-		"INVALID"
-	};
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
 
-	dev_info(ts->dev, "%s: %s\n", __func__,
-		ts->power_state < CY_INVALID_STATE ?
-		cyttsp_powerstate_string[ts->power_state] :
-		"INVALID");
+	return sprintf(buf, "%d\n", ts->predict_ms);
 }
 
-static irqreturn_t cyttsp_irq(int irq, void *handle)
+static ssize_t cyttsp_predict_ms_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
 {
-	struct cyttsp *ts = handle;
-	int retval;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	unsigned long val;
 
-	if (ts->power_state == CY_BL_STATE)
-		complete(&ts->bl_ready);
-	else {
-		/* process the touches */
-		retval = cyttsp_handle_tchdata(ts);
+	if (strict_strtoul(buf, 10, &val) || val > CY_PRED_MAX_MS)
+		return -EINVAL;
 
-		if (retval < 0) {
-			/*
-			 * TTSP device has reset back to bootloader mode.
-			 * Restore to operational mode.
-			 */
-			retval = cyttsp_exit_bl_mode(ts);
-			if (retval)
-				ts->power_state = CY_IDLE_STATE;
-			else
-				ts->power_state = CY_ACTIVE_STATE;
-			cyttsp_pr_state(ts);
-		}
-	}
+	ts->predict_ms = val;
 
-	return IRQ_HANDLED;
+	return count;
 }
 
-static int cyttsp_power_on(struct cyttsp *ts)
+static DEVICE_ATTR(predict_ms, S_IRUGO | S_IWUSR,
+		   cyttsp_predict_ms_show, cyttsp_predict_ms_store);
+
+static ssize_t cyttsp_xform_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	int retval = 0;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
 
-	if (!ts)
-		return -ENOMEM;
+	return sprintf(buf, "0x%02x\n", ts->xform);
+}
 
-	ts->power_state = CY_BL_STATE;
+static ssize_t cyttsp_xform_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	unsigned long val;
+	unsigned long irqflags;
 
-	/* enable interrupts */
-	retval = request_threaded_irq(ts->irq, NULL, cyttsp_irq,
-		IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
-		ts->platform_data->name, ts);
-	if (retval < 0)
-		goto bypass;
+	if (strict_strtoul(buf, 0, &val) ||
+	    val & ~(CY_XFORM_SWAP_XY | CY_XFORM_INVERT_X | CY_XFORM_INVERT_Y))
+		return -EINVAL;
 
-	retval = cyttsp_soft_reset(ts);
-	if (retval == 0)
-		goto bypass;
+	spin_lock_irqsave(&ts->xform_lock, irqflags);
+	ts->xform = val;
+	cyttsp_xform_update(ts);
+	spin_unlock_irqrestore(&ts->xform_lock, irqflags);
 
-	retval = cyttsp_bl_app_valid(ts);
-	if (retval < 0)
-		goto bypass;
-	else if (retval > 0)
-		goto no_bl_bypass;
+	return count;
+}
 
-	retval = cyttsp_exit_bl_mode(ts);
+static DEVICE_ATTR(xform, S_IRUGO | S_IWUSR,
+		   cyttsp_xform_show, cyttsp_xform_store);
 
-	if (retval < 0)
-		goto bypass;
+static ssize_t cyttsp_calib_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	const s32 *c = ts->calib;
 
-	ts->power_state = CY_IDLE_STATE;
+	return sprintf(buf, "%d %d %d %d %d %d\n",
+		       c[0], c[1], c[2], c[3], c[4], c[5]);
+}
 
-no_bl_bypass:
-	retval = cyttsp_set_sysinfo_mode(ts);
-	if (retval < 0)
-		goto bypass;
+static ssize_t cyttsp_calib_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	s32 c[CY_XFORM_NUM_COEF];
+	unsigned long irqflags;
 
-	retval = cyttsp_set_sysinfo_regs(ts);
-	if (retval < 0)
-		goto bypass;
+	if (sscanf(buf, "%d %d %d %d %d %d",
+		   &c[0], &c[1], &c[2], &c[3], &c[4], &c[5]) !=
+	    CY_XFORM_NUM_COEF)
+		return -EINVAL;
 
-	retval = cyttsp_set_operational_mode(ts);
-	if (retval < 0)
-		goto bypass;
+	spin_lock_irqsave(&ts->xform_lock, irqflags);
+	memcpy(ts->calib, c, sizeof(ts->calib));
+	cyttsp_xform_update(ts);
+	spin_unlock_irqrestore(&ts->xform_lock, irqflags);
 
-	/* init active distance */
-	retval = cyttsp_act_dist_setup(ts);
-	if (retval < 0)
-		goto bypass;
+	return count;
+}
 
-	ts->power_state = CY_ACTIVE_STATE;
-	retval = 0;
+static DEVICE_ATTR(calib, S_IRUGO | S_IWUSR,
+		   cyttsp_calib_show, cyttsp_calib_store);
 
-bypass:
-	cyttsp_pr_state(ts);
-	return retval;
+static ssize_t cyttsp_diag_mode_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+
+	return sprintf(buf, "0x%02x\n", ts->diag_mode);
 }
 
-#ifdef CONFIG_PM
-int cyttsp_resume(void *handle)
+static ssize_t cyttsp_diag_mode_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
 {
-	struct cyttsp *ts = handle;
-	int retval = 0;
-	struct cyttsp_xydata xydata;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	unsigned long val;
+	int retval;
 
-	if (!ts)
-		return retval;
+	if (strict_strtoul(buf, 0, &val))
+		return -EINVAL;
 
-	if (ts->platform_data->use_sleep && (ts->power_state !=
-					     CY_ACTIVE_STATE)) {
+	switch (val) {
+	case 0:
+	case CY_DIAG_RAW_MODE:
+	case CY_DIAG_SIG_MODE:
+	case CY_DIAG_IDAC_MODE:
+	case CY_DIAG_RAWBASE_MODE:
+		break;
+	default:
+		return -EINVAL;
+	}
 
-		if (ts->platform_data->wakeup)
-			retval = ts->platform_data->wakeup();
-		else
-			retval = -ENOSYS;
+	if (!ts->diag_ring)
+		return -ENODEV;
 
-		if (retval >= 0) {
-			retval = ttsp_read_block_data(ts, CY_REG_BASE,
-						      sizeof(xydata),
-						      &xydata);
-			if (retval >= 0 &&
-			    !GET_HSTMODE(xydata.hst_mode))
-				ts->power_state = CY_ACTIVE_STATE;
-		}
-	}
+	mutex_lock(&ts->gov.lock);
+	retval = cyttsp_diag_set(ts, val);
+	mutex_unlock(&ts->gov.lock);
 
-	return retval;
+	return retval ? retval : count;
 }
-EXPORT_SYMBOL_GPL(cyttsp_resume);
 
-int cyttsp_suspend(void *handle)
+static DEVICE_ATTR(diag_mode, S_IRUGO | S_IWUSR,
+		   cyttsp_diag_mode_show, cyttsp_diag_mode_store);
+
+/* any write loads fw_name again and flashes it whatever its version */
+static ssize_t cyttsp_fw_update_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
 {
-	struct cyttsp *ts = handle;
-	u8 sleep_mode = 0;
-	int retval = 0;
+	struct cyttsp *ts = input_get_drvdata(to_input_dev(dev));
+	int retval;
 
-	if (ts->platform_data->use_sleep &&
-		(ts->power_state == CY_ACTIVE_STATE)) {
-		sleep_mode = ts->platform_data->use_sleep;
-		retval = ttsp_write_block_data(ts,
-			CY_REG_BASE, sizeof(sleep_mode), &sleep_mode);
-		if (retval >= 0)
-			ts->power_state = CY_SLEEP_STATE;
-	}
+	retval = cyttsp_fw_request(ts, true);
 
-	return retval;
+	return retval ? retval : count;
 }
-EXPORT_SYMBOL_GPL(cyttsp_suspend);
-#endif
+
+static DEVICE_ATTR(fw_update, S_IWUSR, NULL, cyttsp_fw_update_store);
+
+static struct attribute *cyttsp_attrs[] = {
+	&dev_attr_intrvl.attr,
+	&dev_attr_fw_update.attr,
+	&dev_attr_diag_mode.attr,
+	&dev_attr_irq_prio.attr,
+	&dev_attr_irq_cpus.attr,
+	&dev_attr_jitter.attr,
+	&dev_attr_predict_ms.attr,
+	&dev_attr_xform.attr,
+	&dev_attr_calib.attr,
+	&dev_attr_gov_enable.attr,
+	&dev_attr_gov_fast_intrvl.attr,
+	&dev_attr_gov_idle_tmout.attr,
+	&dev_attr_gov_speed.attr,
+	&dev_attr_gov_hold_ms.attr,
+	NULL
+};
+
+static const struct attribute_group cyttsp_attr_group = {
+	.attrs = cyttsp_attrs,
+};
 
 static int cyttsp_open(struct input_dev *dev)
 {
 	struct cyttsp *ts = input_get_drvdata(dev);
+	int retval;
 
-	return cyttsp_power_on(ts);
+	/*
+	 * bring-up was started at probe; only wait if it is still running,
+	 * and try again if it failed rather than failing every open
+	 */
+	if (ts->platform_data->use_async_init) {
+		wait_for_completion(&ts->startup_done);
+		if (ts->startup_ret < 0)
+			ts->startup_ret = cyttsp_power_on(ts);
+		retval = ts->startup_ret;
+	} else
+		retval = cyttsp_power_on(ts);
+
+	/* out of low power if it was parked there, then idle from now */
+	if (!retval) {
+		pm_runtime_get_sync(ts->dev);
+		pm_runtime_mark_last_busy(ts->dev);
+		pm_runtime_put_autosuspend(ts->dev);
+	}
+
+	return retval;
 }
 
 void cyttsp_core_release(void *handle)
@@ -656,11 +4020,23 @@ void cyttsp_core_release(void *handle)
 	struct cyttsp *ts = handle;
 
 	if (ts) {
-		free_irq(ts->irq, ts);
+		pm_runtime_disable(ts->dev);
+		cyttsp_debugfs_exit(ts);
+		sysfs_remove_group(&ts->input->dev.kobj, &cyttsp_attr_group);
+		cyttsp_diag_stop(ts);
+		wait_for_completion(&ts->fw_done);
+		cancel_work_sync(&ts->startup_work);
+		cyttsp_gov_exit(ts);
+		cyttsp_free_irq(ts);
+		cyttsp_drain(ts);
+		cyttsp_diag_exit(ts);
+		cyttsp_trace_exit(ts);
+		if (ts->ring_wq)
+			destroy_workqueue(ts->ring_wq);
 		input_unregister_device(ts->input);
 		if (ts->platform_data->exit)
 			ts->platform_data->exit();
-		input_mt_destroy_slots(ts->input);
+		cyttsp_mt_destroy(ts->input);
 		kfree(ts);
 	}
 }
@@ -670,31 +4046,57 @@ static void cyttsp_close(struct input_dev *dev)
 {
 	struct cyttsp *ts = input_get_drvdata(dev);
 
-	free_irq(ts->irq, ts);
+	/* an asynchronously started device stays up until it is released */
+	if (!ts->platform_data->use_async_init)
+		cyttsp_free_irq(ts);
+
+	/* nobody is looking; no need to wait for the delay */
+	pm_runtime_suspend(ts->dev);
 }
 
 void *cyttsp_core_init(struct cyttsp_bus_ops *bus_ops,
 		       struct device *dev, int irq)
 {
 	struct input_dev *input_device;
-	int ret;
+	int ret = -EINVAL;
+	int i;
 
 	struct cyttsp *ts = kzalloc(sizeof(*ts), GFP_KERNEL);
 
 	if (!ts) {
 		pr_err("%s: Error, kzalloc\n", __func__);
+		ret = -ENOMEM;
 		goto error_alloc_data;
 	}
 
-	if (dev == NULL || bus_ops == NULL) {
+	if (dev == NULL || bus_ops == NULL || bus_ops->frame_buf == NULL) {
 		kfree(ts);
 		goto error_alloc_data;
 	}
 
+	BUILD_BUG_ON(sizeof(struct cyttsp_xydata) > CY_FRAME_BUF_SIZE);
+
 	ts->dev = dev;
 	ts->platform_data = dev->platform_data;
 	ts->bus_ops = bus_ops;
+	ts->xy_data = bus_ops->frame_buf;
 	init_completion(&ts->bl_ready);
+	INIT_WORK(&ts->bl_work, cyttsp_bl_work);
+	init_completion(&ts->startup_done);
+	INIT_WORK(&ts->startup_work, cyttsp_startup_work);
+	init_completion(&ts->fw_done);
+	complete(&ts->fw_done);
+	cyttsp_config_init(ts);
+	cyttsp_gov_init(ts);
+	ts->jitter = ts->platform_data->use_dedup ?
+		ts->platform_data->jitter : -1;
+	ts->predict_ms = min_t(int, ts->platform_data->predict_ms,
+			       CY_PRED_MAX_MS);
+	cyttsp_xform_init(ts);
+	ts->irq_prio = ts->platform_data->irq_prio;
+	for_each_set_bit(i, &ts->platform_data->irq_cpus, BITS_PER_LONG)
+		if (i < nr_cpu_ids)
+			cpumask_set_cpu(i, &ts->irq_mask);
 
 	if (ts->platform_data->init) {
 		if (ts->platform_data->init()) {
@@ -705,17 +4107,29 @@ void *cyttsp_core_init(struct cyttsp_bus_ops *bus_ops,
 	}
 
 	ts->irq = irq;
-	if (ts->irq <= 0) {
+	if (ts->irq < 0) {
 		dev_dbg(ts->dev, "%s: Error, failed to allocate irq\n",
 			__func__);
 			goto error_init;
 	}
 
+	INIT_WORK(&ts->ring_work, cyttsp_ring_work);
+	if (ts->platform_data->use_frame_ring) {
+		ts->ring_wq = create_singlethread_workqueue(dev_name(dev));
+		if (!ts->ring_wq) {
+			dev_dbg(ts->dev, "%s: Error, failed to create decoder\n",
+				__func__);
+			ret = -ENOMEM;
+			goto error_create_wq;
+		}
+	}
+
 	/* Create the input device and register it. */
 	input_device = input_allocate_device();
 	if (!input_device) {
 		dev_dbg(ts->dev, "%s: Error, failed to allocate input device\n",
 			__func__);
+		ret = -ENOMEM;
 		goto error_input_allocate_device;
 	}
 
@@ -739,7 +4153,28 @@ void *cyttsp_core_init(struct cyttsp_bus_ops *bus_ops,
 	input_set_abs_params(input_device, ABS_MT_TOUCH_MAJOR,
 			     0, CY_MAXZ, 0, 0);
 
-	input_mt_init_slots(input_device, CY_MAX_ID);
+	cyttsp_mt_init(input_device);
+
+	for (i = 0; i < ts->platform_data->num_vkeys; i++)
+		__set_bit(ts->platform_data->vkeys[i].code,
+			  input_device->keybit);
+
+	input_set_capability(input_device, EV_MSC, MSC_TIMESTAMP);
+
+	if (ts->platform_data->use_gestures) {
+		input_set_capability(input_device, EV_MSC, MSC_GESTURE);
+		for (i = 0; i < ts->platform_data->num_gest_keys; i++)
+			__set_bit(ts->platform_data->gest_keys[i].code,
+				  input_device->keybit);
+	}
+
+	/*
+	 * Power on in parallel with the rest of the boot. This has to be
+	 * queued before registering, since a handler may open the device
+	 * right away and wait for it.
+	 */
+	if (ts->platform_data->use_async_init)
+		schedule_work(&ts->startup_work);
 
 	ret = input_register_device(input_device);
 	if (ret) {
@@ -748,18 +4183,45 @@ void *cyttsp_core_init(struct cyttsp_bus_ops *bus_ops,
 		goto error_input_register_device;
 	}
 
-	goto no_error;
+	ret = sysfs_create_group(&input_device->dev.kobj, &cyttsp_attr_group);
+	if (ret)
+		dev_err(ts->dev, "%s: Error, failed to create sysfs group: %d\n",
+			__func__, ret);
+
+	ret = cyttsp_diag_init(ts);
+	if (ret)
+		dev_err(ts->dev, "%s: Error, failed to set up diag device: %d\n",
+			__func__, ret);
+
+	cyttsp_debugfs_init(ts);
+	cyttsp_trace_init(ts);
+	pm_runtime_set_autosuspend_delay(ts->dev, ts->platform_data->idle_ms ?
+		ts->platform_data->idle_ms : CY_IDLE_MS_DFLT);
+	pm_runtime_use_autosuspend(ts->dev);
+	pm_runtime_enable(ts->dev);
+
+	/* the update runs once the image is there; boot does not wait */
+	if (ts->platform_data->fw_name)
+		cyttsp_fw_request(ts, false);
+
+	return ts;
 
 error_input_register_device:
+	cancel_work_sync(&ts->startup_work);
+	cyttsp_gov_exit(ts);
+	cyttsp_free_irq(ts);
+	cyttsp_drain(ts);
 	input_free_device(input_device);
 error_input_allocate_device:
+	if (ts->ring_wq)
+		destroy_workqueue(ts->ring_wq);
+error_create_wq:
 	if (ts->platform_data->exit)
 		ts->platform_data->exit();
 error_init:
 	kfree(ts);
 error_alloc_data:
-no_error:
-	return ts;
+	return ERR_PTR(ret);
 }
 EXPORT_SYMBOL_GPL(cyttsp_core_init);
 
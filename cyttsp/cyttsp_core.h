@@ -37,17 +37,104 @@
 #include <linux/err.h>
 #include <linux/module.h>
 #include <linux/input/cyttsp.h>
+#include <linux/version.h>
+#include <linux/pm_runtime.h>
 
 #define CY_NUM_RETRY                4 /* max number of retries for read ops */
+#define CY_FRAME_BUF_SIZE           32 /* one TTSP Gen3 touch data frame */
 
+/*
+ * Runtime PM for the 2.6.32 Android kernels, which have no autosuspend:
+ * there the delay is ignored and an idle device is suspended right away.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
+static inline void pm_runtime_mark_last_busy(struct device *dev)
+{
+}
+
+static inline void pm_runtime_use_autosuspend(struct device *dev)
+{
+}
+
+static inline void pm_runtime_set_autosuspend_delay(struct device *dev,
+						    int delay)
+{
+}
+
+static inline int pm_runtime_put_autosuspend(struct device *dev)
+{
+	return pm_runtime_put(dev);
+}
 
+static inline int pm_runtime_autosuspend(struct device *dev)
+{
+	return pm_runtime_suspend(dev);
+}
+#endif
+#ifndef SET_SYSTEM_SLEEP_PM_OPS
+#ifdef CONFIG_PM_SLEEP
+#define SET_SYSTEM_SLEEP_PM_OPS(suspend_fn, resume_fn) \
+	.suspend = suspend_fn, \
+	.resume = resume_fn, \
+	.freeze = suspend_fn, \
+	.thaw = resume_fn, \
+	.poweroff = suspend_fn, \
+	.restore = resume_fn,
+#else
+#define SET_SYSTEM_SLEEP_PM_OPS(suspend_fn, resume_fn)
+#endif
+#endif
+#ifndef SET_RUNTIME_PM_OPS
+#ifdef CONFIG_PM_RUNTIME
+#define SET_RUNTIME_PM_OPS(suspend_fn, resume_fn, idle_fn) \
+	.runtime_suspend = suspend_fn, \
+	.runtime_resume = resume_fn, \
+	.runtime_idle = idle_fn,
+#else
+#define SET_RUNTIME_PM_OPS(suspend_fn, resume_fn, idle_fn)
+#endif
+#endif
+
+
+/*
+ * read() and write() take any length up to 255 bytes; bus drivers split
+ * what their controller cannot move in one piece.
+ */
 struct cyttsp_bus_ops {
 	s32 (*write)(void *handle, u8 addr, u8 length, const void *values);
 	s32 (*read)(void *handle, u8 addr, u8 length, void *values);
 	s32 (*ext)(void *handle, void *values);
+	/*
+	 * Optional read followed by a one byte write of ack to ack_addr,
+	 * issued back to back as a single bus transaction.
+	 */
+	s32 (*read_ack)(void *handle, u8 addr, u8 length, void *values,
+			u8 ack_addr, u8 ack);
+	/*
+	 * Bytes a read_ack() may fetch beyond what is needed and still cost
+	 * less than a read and a separate write would.
+	 */
+	u8 read_ack_slack;
+	/*
+	 * Optional non-blocking read. done() is called with 0 or a negative
+	 * error once the data is in place, possibly from interrupt context.
+	 */
+	s32 (*read_async)(void *handle, u8 addr, u8 length, void *values,
+			  void (*done)(void *context, int status),
+			  void *context);
+	/*
+	 * kmalloc'd, cacheline aligned buffer of at least CY_FRAME_BUF_SIZE
+	 * bytes. The core reads touch frames into it and decodes them in
+	 * place, so it has to be usable for DMA by the bus controller.
+	 */
+	void *frame_buf;
 	struct device *dev;
 };
 
+/*
+ * irq 0 makes an instance without a controller behind it, fed only by
+ * debugfs replay; see cyttsp_replay.c.
+ */
 void *cyttsp_core_init(struct cyttsp_bus_ops *bus_ops,
 		       struct device *dev, int irq);
 
@@ -56,5 +143,9 @@ void cyttsp_core_release(void *handle);
 int cyttsp_resume(void *handle);
 int cyttsp_suspend(void *handle);
 #endif
+#ifdef CONFIG_PM_RUNTIME
+int cyttsp_runtime_resume(void *handle);
+int cyttsp_runtime_suspend(void *handle);
+#endif
 
 #endif /* __CYTTSP_CORE_H__ */
@@ -33,58 +33,165 @@
 
 #include <linux/i2c.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
+#include <linux/mutex.h>
+#include <linux/pm_runtime.h>
 
-#define CY_I2C_DATA_SIZE  128
+#define CY_I2C_DATA_SIZE  128 /* largest write message, register included */
+#define CY_I2C_MAX_LEN    0xFF /* largest length the bus ops take */
+#define CY_I2C_MAX_MSGS   DIV_ROUND_UP(CY_I2C_MAX_LEN, CY_I2C_DATA_SIZE - 1)
+/* a separate handshake costs its 3 bytes plus a transfer's setup and irq */
+#define CY_I2C_ACK_SLACK  6
 
 struct cyttsp_i2c {
 	struct cyttsp_bus_ops ops;
 	struct i2c_client *client;
 	void *ttsp_client;
-	u8 wr_buf[CY_I2C_DATA_SIZE];
+	bool use_smbus;	/* adapter only does SMBus i2c block transfers */
+	struct mutex lock;	/* wr_buf and multi-transaction sequences */
+	u8 wr_buf[CY_I2C_MAX_MSGS][CY_I2C_DATA_SIZE];
 };
 
 static s32 ttsp_i2c_read_block_data(void *handle, u8 addr,
 	u8 length, void *values)
 {
 	struct cyttsp_i2c *ts = container_of(handle, struct cyttsp_i2c, ops);
-	int retval = 0;
+	struct i2c_msg msgs[2];
+	int retval;
+
+	if (ts->use_smbus) {
+		u8 off, chunk;
+
+		mutex_lock(&ts->lock);
+		for (off = 0, retval = 0; off < length; off += chunk) {
+			chunk = min_t(u8, length - off, I2C_SMBUS_BLOCK_MAX);
+			retval = i2c_smbus_read_i2c_block_data(ts->client,
+					addr + off, chunk, (u8 *)values + off);
+			if (retval < 0)
+				break;
+			if (retval != chunk) {
+				retval = -EIO;
+				break;
+			}
+			retval = 0;
+		}
+		mutex_unlock(&ts->lock);
+
+		return retval;
+	}
 
-	retval = i2c_master_send(ts->client, &addr, 1);
+	/*
+	 * Register address write and data read with a repeated start. It is
+	 * a single transfer into the caller's buffer, so it needs no lock.
+	 */
+	msgs[0].addr = ts->client->addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &addr;
+
+	msgs[1].addr = ts->client->addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = values;
+
+	retval = i2c_transfer(ts->client->adapter, msgs, ARRAY_SIZE(msgs));
 	if (retval < 0)
 		return retval;
 
-	retval = i2c_master_recv(ts->client, values, length);
+	return (retval != ARRAY_SIZE(msgs)) ? -EIO : 0;
+}
+
+static s32 ttsp_i2c_read_block_data_ack(void *handle, u8 addr,
+	u8 length, void *values, u8 ack_addr, u8 ack)
+{
+	struct cyttsp_i2c *ts = container_of(handle, struct cyttsp_i2c, ops);
+	struct i2c_msg msgs[3];
+	u8 ack_buf[2] = { ack_addr, ack };
+	int retval;
+
+	msgs[0].addr = ts->client->addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &addr;
 
-	if (retval > 0 && != length)
-		return -EIO;
+	msgs[1].addr = ts->client->addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = values;
 
-	return (retval < 0) ? retval : 0;
+	msgs[2].addr = ts->client->addr;
+	msgs[2].flags = 0;
+	msgs[2].len = sizeof(ack_buf);
+	msgs[2].buf = ack_buf;
+
+	retval = i2c_transfer(ts->client->adapter, msgs, ARRAY_SIZE(msgs));
+	if (retval < 0)
+		return retval;
+
+	return (retval != ARRAY_SIZE(msgs)) ? -EIO : 0;
 }
 
 static s32 ttsp_i2c_write_block_data(void *handle, u8 addr,
 	u8 length, const void *values)
 {
 	struct cyttsp_i2c *ts = container_of(handle, struct cyttsp_i2c, ops);
+	struct i2c_msg msgs[CY_I2C_MAX_MSGS];
+	const u8 *data = values;
+	u8 off = 0;
+	u8 chunk;
+	int n;
 	int retval;
 
-	ts->wr_buf[0] = addr;
-	memcpy(&ts->wr_buf[1], values, length);
+	mutex_lock(&ts->lock);
 
-	retval = i2c_master_send(ts->client, ts->wr_buf, length+1);
+	if (ts->use_smbus) {
+		for (off = 0, retval = 0; off < length; off += chunk) {
+			chunk = min_t(u8, length - off, I2C_SMBUS_BLOCK_MAX);
+			retval = i2c_smbus_write_i2c_block_data(ts->client,
+					addr + off, chunk, data + off);
+			if (retval < 0)
+				break;
+		}
 
-	if (retval != length)
-		return -EIO;
+		goto exit;
+	}
 
-	return (retval < 0) ? retval : 0;
+	/*
+	 * Each message is a complete register write of its own part of the
+	 * data, so the whole block still goes out in a single transfer.
+	 */
+	for (n = 0; off < length || !n; n++, off += chunk) {
+		chunk = min_t(u8, length - off, CY_I2C_DATA_SIZE - 1);
+		ts->wr_buf[n][0] = addr + off;
+		memcpy(&ts->wr_buf[n][1], data + off, chunk);
+
+		msgs[n].addr = ts->client->addr;
+		msgs[n].flags = 0;
+		msgs[n].len = chunk + 1;
+		msgs[n].buf = ts->wr_buf[n];
+	}
+
+	retval = i2c_transfer(ts->client->adapter, msgs, n);
+	if (retval >= 0)
+		retval = (retval != n) ? -EIO : 0;
+
+exit:
+	mutex_unlock(&ts->lock);
+	return retval;
 }
 
 static int __devinit cyttsp_i2c_probe(struct i2c_client *client,
 	const struct i2c_device_id *id)
 {
 	struct cyttsp_i2c *ts;
+	bool use_smbus = false;
 
-	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C))
-		return -EIO;
+	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C)) {
+		if (!i2c_check_functionality(client->adapter,
+					     I2C_FUNC_SMBUS_I2C_BLOCK))
+			return -EIO;
+		use_smbus = true;
+	}
 
 	/* allocate and clear memory */
 	ts = kzalloc(sizeof(*ts), GFP_KERNEL);
@@ -93,16 +200,31 @@ static int __devinit cyttsp_i2c_probe(struct i2c_client *client,
 		return -ENOMEM;
 	}
 
+	ts->ops.frame_buf = kmalloc(L1_CACHE_ALIGN(CY_FRAME_BUF_SIZE),
+				    GFP_KERNEL);
+	if (!ts->ops.frame_buf) {
+		dev_dbg(&client->dev, "%s: Error, kmalloc frame.\n", __func__);
+		kfree(ts);
+		return -ENOMEM;
+	}
+
 	/* register driver_data */
 	ts->client = client;
+	ts->use_smbus = use_smbus;
+	mutex_init(&ts->lock);
 	i2c_set_clientdata(client, ts);
 	ts->ops.write = ttsp_i2c_write_block_data;
 	ts->ops.read = ttsp_i2c_read_block_data;
+	if (!use_smbus) {
+		ts->ops.read_ack = ttsp_i2c_read_block_data_ack;
+		ts->ops.read_ack_slack = CY_I2C_ACK_SLACK;
+	}
 	ts->ops.dev = &client->dev;
 
 	ts->ttsp_client = cyttsp_core_init(&ts->ops, &client->dev, client->irq);
 	if (IS_ERR(ts->ttsp_client)) {
 		int retval = PTR_ERR(ts->ttsp_client);
+		kfree(ts->ops.frame_buf);
 		kfree(ts);
 		return retval;
 	}
@@ -118,6 +240,7 @@ static int __devexit cyttsp_i2c_remove(struct i2c_client *client)
 
 	ts = i2c_get_clientdata(client);
 	cyttsp_core_release(ts->ttsp_client);
+	kfree(ts->ops.frame_buf);
 	kfree(ts);
 	return 0;
 }
@@ -138,7 +261,38 @@ static int cyttsp_i2c_resume(struct device *dev)
 
 	return cyttsp_resume(ts->ttsp_client);
 }
-static SIMPLE_DEV_PM_OPS(cyttsp_i2c_pm, cyttsp_i2c_suspend, cyttsp_i2c_resume);
+
+#ifdef CONFIG_PM_RUNTIME
+static int cyttsp_i2c_runtime_suspend(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct cyttsp_i2c *ts = i2c_get_clientdata(client);
+
+	return cyttsp_runtime_suspend(ts->ttsp_client);
+}
+
+static int cyttsp_i2c_runtime_resume(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct cyttsp_i2c *ts = i2c_get_clientdata(client);
+
+	return cyttsp_runtime_resume(ts->ttsp_client);
+}
+
+/* let the autosuspend delay run out instead of suspending right away */
+static int cyttsp_i2c_runtime_idle(struct device *dev)
+{
+	pm_runtime_autosuspend(dev);
+	return -EBUSY;
+}
+#endif
+
+static const struct dev_pm_ops cyttsp_i2c_pm = {
+	SET_SYSTEM_SLEEP_PM_OPS(cyttsp_i2c_suspend, cyttsp_i2c_resume)
+	SET_RUNTIME_PM_OPS(cyttsp_i2c_runtime_suspend,
+			   cyttsp_i2c_runtime_resume,
+			   cyttsp_i2c_runtime_idle)
+};
 #endif
 
 static const struct i2c_device_id cyttsp_i2c_id[] = {
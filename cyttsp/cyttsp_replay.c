@@ -0,0 +1,165 @@
+/*
+ * Source for:
+ * Cypress TrueTouch(TM) Standard Product (TTSP) trace replay device.
+ * An instance of the core with no controller behind it, so that frame
+ * traces taken through debugfs can be replayed through the decoder on a
+ * machine without the panel, e.g. for regression and timing runs:
+ *
+ *   cat trace.bin > /sys/kernel/debug/<device>/replay
+ *   cat /sys/kernel/debug/<device>/replay_stats
+ *
+ * Copyright (C) 2009, 2010, 2011 Cypress Semiconductor, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, and only version 2, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Contact Cypress Semiconductor at www.cypress.com <kev@cypress.com>
+ *
+ */
+
+#include "cyttsp_core.h"
+
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/cache.h>
+
+#define CY_REPLAY_NAME    "cyttsp-replay"
+
+/* the panel the trace was taken on; only the reported range depends on it */
+static unsigned int maxx = 480;
+module_param(maxx, uint, S_IRUGO);
+MODULE_PARM_DESC(maxx, "largest reported x");
+static unsigned int maxy = 800;
+module_param(maxy, uint, S_IRUGO);
+MODULE_PARM_DESC(maxy, "largest reported y");
+static bool use_gestures;
+module_param(use_gestures, bool, S_IRUGO);
+MODULE_PARM_DESC(use_gestures, "the trace carries gesture frames");
+
+struct cyttsp_replay {
+	struct cyttsp_bus_ops ops;
+	void *ttsp_client;
+};
+
+static struct platform_device *cyttsp_replay_pdev;
+
+/* the core swaps in the trace for the duration of a replay */
+static s32 cyttsp_replay_read_block_data(void *handle, u8 addr,
+	u8 length, void *values)
+{
+	return -ENODEV;
+}
+
+/* mode and handshake writes have nobody to go to */
+static s32 cyttsp_replay_write_block_data(void *handle, u8 addr,
+	u8 length, const void *values)
+{
+	return 0;
+}
+
+static int __devinit cyttsp_replay_probe(struct platform_device *pdev)
+{
+	struct cyttsp_replay *ts;
+
+	ts = kzalloc(sizeof(*ts), GFP_KERNEL);
+	if (!ts) {
+		dev_dbg(&pdev->dev, "%s: Error, kzalloc.\n", __func__);
+		return -ENOMEM;
+	}
+
+	ts->ops.frame_buf = kmalloc(L1_CACHE_ALIGN(CY_FRAME_BUF_SIZE),
+				    GFP_KERNEL);
+	if (!ts->ops.frame_buf) {
+		dev_dbg(&pdev->dev, "%s: Error, kmalloc frame.\n", __func__);
+		kfree(ts);
+		return -ENOMEM;
+	}
+
+	platform_set_drvdata(pdev, ts);
+	ts->ops.write = cyttsp_replay_write_block_data;
+	ts->ops.read = cyttsp_replay_read_block_data;
+	ts->ops.dev = &pdev->dev;
+
+	/* no irq: the core brings nothing up and only decodes replays */
+	ts->ttsp_client = cyttsp_core_init(&ts->ops, &pdev->dev, 0);
+	if (IS_ERR(ts->ttsp_client)) {
+		int retval = PTR_ERR(ts->ttsp_client);
+		kfree(ts->ops.frame_buf);
+		kfree(ts);
+		return retval;
+	}
+
+	return 0;
+}
+
+static int __devexit cyttsp_replay_remove(struct platform_device *pdev)
+{
+	struct cyttsp_replay *ts = platform_get_drvdata(pdev);
+
+	cyttsp_core_release(ts->ttsp_client);
+	kfree(ts->ops.frame_buf);
+	kfree(ts);
+
+	return 0;
+}
+
+static struct platform_driver cyttsp_replay_driver = {
+	.driver = {
+		.name = CY_REPLAY_NAME,
+		.owner = THIS_MODULE,
+	},
+	.probe = cyttsp_replay_probe,
+	.remove = __devexit_p(cyttsp_replay_remove),
+};
+
+static int __init cyttsp_replay_init(void)
+{
+	struct cyttsp_platform_data pdata = {
+		.maxx = maxx,
+		.maxy = maxy,
+		.use_gestures = use_gestures,
+		.act_dist = CY_ACT_DIST_DFLT,
+		.act_intrvl = CY_ACT_INTRVL_DFLT,
+		.tch_tmout = CY_TCH_TMOUT_DFLT,
+		.lp_intrvl = CY_LP_INTRVL_DFLT,
+		.name = CY_REPLAY_NAME,
+	};
+	int retval;
+
+	retval = platform_driver_register(&cyttsp_replay_driver);
+	if (retval)
+		return retval;
+
+	cyttsp_replay_pdev = platform_device_register_data(NULL,
+		CY_REPLAY_NAME, -1, &pdata, sizeof(pdata));
+	if (IS_ERR(cyttsp_replay_pdev)) {
+		platform_driver_unregister(&cyttsp_replay_driver);
+		return PTR_ERR(cyttsp_replay_pdev);
+	}
+
+	return 0;
+}
+
+static void __exit cyttsp_replay_exit(void)
+{
+	platform_device_unregister(cyttsp_replay_pdev);
+	platform_driver_unregister(&cyttsp_replay_driver);
+}
+
+module_init(cyttsp_replay_init);
+module_exit(cyttsp_replay_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Cypress TrueTouch(R) Standard Product (TTSP) replay device");
+MODULE_AUTHOR("Cypress");
@@ -33,6 +33,10 @@
 
 #include <linux/spi/spi.h>
 #include <linux/delay.h>
+#include <linux/cache.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/pm_runtime.h>
 
 #define CY_SPI_WR_OP      0x00 /* r/~w */
 #define CY_SPI_RD_OP      0x01
@@ -40,36 +44,88 @@
 #define CY_SPI_SYNC_BYTE  2
 #define CY_SPI_SYNC_ACK1  0x62 /* from protocol v.2 */
 #define CY_SPI_SYNC_ACK2  0x9D /* from protocol v.2 */
-#define CY_SPI_DATA_SIZE  128
-#define CY_SPI_DATA_BUF_SIZE (CY_SPI_CMD_BYTES + CY_SPI_DATA_SIZE)
+#define CY_SPI_DATA_SIZE  128 /* largest single spi_transfer of data */
+/* a few bytes at SPI clock rates are cheaper than queueing another message */
+#define CY_SPI_ACK_SLACK  CY_FRAME_BUF_SIZE
+#define CY_SPI_MAX_LEN    0xFF /* largest length the bus ops take */
+#define CY_SPI_MAX_SEGS   DIV_ROUND_UP(CY_SPI_MAX_LEN, CY_SPI_DATA_SIZE)
+#define CY_SPI_DATA_BUF_SIZE (CY_SPI_CMD_BYTES + CY_SPI_MAX_LEN)
 #define CY_SPI_BITS_PER_WORD 8
+#define CY_SPI_ASYNC_NUM  2 /* preallocated asynchronous read messages */
+
+struct cyttsp_spi;
+
+struct cyttsp_spi_async {
+	struct cyttsp_spi *ts;
+	struct spi_message msg;
+	struct spi_transfer xfer[2];
+	void (*done)(void *context, int status);
+	void *context;
+	/* DMA buffers; each starts on its own cacheline */
+	u8 cmd_buf[CY_SPI_CMD_BYTES] ____cacheline_aligned;
+	u8 ack_buf[CY_SPI_CMD_BYTES] ____cacheline_aligned;
+};
 
 struct cyttsp_spi {
 	struct cyttsp_bus_ops bus_ops;
 	struct spi_device *spi_client;
 	void *ttsp_client;
-	u8 wr_buf[CY_SPI_DATA_BUF_SIZE];
-	u8 rd_buf[CY_SPI_DATA_BUF_SIZE];
+	struct mutex lock;	/* wr_buf and rd_buf of the sync transfers */
+	unsigned long async_busy;	/* one bit per async[] entry */
+	struct cyttsp_spi_async async[CY_SPI_ASYNC_NUM];
+	/* DMA buffers; kept last so no other field shares their cachelines */
+	u8 wr_buf[CY_SPI_DATA_BUF_SIZE] ____cacheline_aligned;
+	u8 rd_buf[CY_SPI_DATA_BUF_SIZE] ____cacheline_aligned;
 };
 
+static bool cyttsp_spi_sync_ok(const u8 *rd_buf)
+{
+	return rd_buf[CY_SPI_SYNC_BYTE] == CY_SPI_SYNC_ACK1 &&
+	       rd_buf[CY_SPI_SYNC_BYTE + 1] == CY_SPI_SYNC_ACK2;
+}
+
+/*
+ * Queue len bytes of data as chained transfers of at most CY_SPI_DATA_SIZE
+ * each. They all go out under the same chip select, so the controller
+ * sees one command however the data is split. Returns the transfers used.
+ */
+static int cyttsp_spi_add_data(struct spi_message *msg,
+			       struct spi_transfer *xfer,
+			       const u8 *tx_buf, u8 *rx_buf, int len)
+{
+	int off, n = 0;
+
+	for (off = 0; off < len; off += xfer[n++].len) {
+		xfer[n].tx_buf = tx_buf ? tx_buf + off : NULL;
+		xfer[n].rx_buf = rx_buf ? rx_buf + off : NULL;
+		xfer[n].len = min(len - off, CY_SPI_DATA_SIZE);
+		spi_message_add_tail(&xfer[n], msg);
+	}
+
+	return n;
+}
+
 static int cyttsp_spi_xfer(u8 op, struct cyttsp_spi *ts,
 			   u8 reg, u8 *buf, int length)
 {
 	struct spi_message msg;
-	struct spi_transfer xfer[2];
+	struct spi_transfer xfer[1 + CY_SPI_MAX_SEGS];
 	u8 *wr_buf = ts->wr_buf;
 	u8 *rd_buf = ts->rd_buf;
 	int retval;
 
-	if (length > CY_SPI_DATA_SIZE) {
+	if (length > CY_SPI_MAX_LEN) {
 		dev_dbg(ts->bus_ops.dev,
 			"%s: length %d is too big.\n",
 			__func__, length);
 		return -EINVAL;
 	}
 
-	memset(wr_buf, 0, CY_SPI_DATA_BUF_SIZE);
-	memset(rd_buf, 0, CY_SPI_DATA_BUF_SIZE);
+	mutex_lock(&ts->lock);
+
+	/* stale sync bytes from the previous transfer must not pass */
+	rd_buf[CY_SPI_SYNC_BYTE] = 0;
+	rd_buf[CY_SPI_SYNC_BYTE + 1] = 0;
 
 	wr_buf[0] = 0x00; /* header byte 0 */
 	wr_buf[1] = 0xFF; /* header byte 1 */
@@ -87,23 +143,20 @@ static int cyttsp_spi_xfer(u8 op, struct cyttsp_spi *ts,
 	*/
 	xfer[0].tx_buf = wr_buf;
 	xfer[0].rx_buf = rd_buf;
-	if (op == CY_SPI_WR_OP) {
-		xfer[0].len = length + CY_SPI_CMD_BYTES;
-		spi_message_add_tail(&xfer[0], &msg);
-	} else if (op == CY_SPI_RD_OP) {
-		xfer[0].len = CY_SPI_CMD_BYTES;
-		spi_message_add_tail(&xfer[0], &msg);
-
-		xfer[1].rx_buf = buf;
-		xfer[1].len = length;
-		spi_message_add_tail(&xfer[1], &msg);
-	}
+	xfer[0].len = CY_SPI_CMD_BYTES;
+	spi_message_add_tail(&xfer[0], &msg);
+
+	if (op == CY_SPI_WR_OP)
+		cyttsp_spi_add_data(&msg, &xfer[1], wr_buf + CY_SPI_CMD_BYTES,
+				    rd_buf + CY_SPI_CMD_BYTES, length);
+	else if (op == CY_SPI_RD_OP)
+		cyttsp_spi_add_data(&msg, &xfer[1], NULL, buf, length);
 
 	retval = spi_sync(ts->spi_client, &msg);
 	if (retval < 0) {
 		dev_dbg(ts->bus_ops.dev,
 			"%s: spi_sync() error %d, len=%d, op=%d\n",
-			__func__, retval, xfer[1].len, op);
+			__func__, retval, length, op);
 
 		/*
 		 * do not return here since was a bad ACK sequence
@@ -112,8 +165,7 @@ static int cyttsp_spi_xfer(u8 op, struct cyttsp_spi *ts,
 		 */
 	}
 
-	if ((rd_buf[CY_SPI_SYNC_BYTE] == CY_SPI_SYNC_ACK1) &&
-	    (rd_buf[CY_SPI_SYNC_BYTE+1] == CY_SPI_SYNC_ACK2))
+	if (cyttsp_spi_sync_ok(rd_buf))
 		retval = 0;
 	else {
 		int i;
@@ -130,6 +182,7 @@ static int cyttsp_spi_xfer(u8 op, struct cyttsp_spi *ts,
 		retval = 1;
 	}
 
+	mutex_unlock(&ts->lock);
 	return retval;
 }
 
@@ -151,11 +204,76 @@ static s32 ttsp_spi_read_block_data(void *handle, u8 addr,
 	 * to retry until data sync bytes are found.
 	 */
 	if (retval > 0)
-		retval = -EIO;  /* now signal fail; so retry can be done */
+		retval = -EAGAIN;  /* sync miss, see cyttsp_retry_wait() */
 
 	return retval;
 }
 
+/*
+ * Read followed by the handshake write in one message. Chip select is
+ * toggled between the two so the controller sees two commands, but the
+ * transfer is queued and completed only once.
+ */
+static s32 ttsp_spi_read_block_data_ack(void *handle, u8 addr,
+					u8 length, void *data,
+					u8 ack_addr, u8 ack)
+{
+	struct cyttsp_spi *ts =
+		container_of(handle, struct cyttsp_spi, bus_ops);
+	struct spi_message msg;
+	struct spi_transfer xfer[2 + CY_SPI_MAX_SEGS];
+	u8 *rd_cmd = ts->wr_buf;
+	u8 *rd_sync = ts->rd_buf;
+	u8 *ack_cmd = ts->wr_buf + CY_SPI_CMD_BYTES;
+	u8 *ack_sync = ts->rd_buf + CY_SPI_CMD_BYTES;
+	int n;
+	int retval;
+
+	mutex_lock(&ts->lock);
+
+	rd_sync[CY_SPI_SYNC_BYTE] = 0;
+	rd_sync[CY_SPI_SYNC_BYTE + 1] = 0;
+	ack_sync[CY_SPI_SYNC_BYTE] = 0;
+	ack_sync[CY_SPI_SYNC_BYTE + 1] = 0;
+
+	rd_cmd[0] = 0x00;
+	rd_cmd[1] = 0xFF;
+	rd_cmd[2] = addr;
+	rd_cmd[3] = CY_SPI_RD_OP;
+
+	ack_cmd[0] = 0x00;
+	ack_cmd[1] = 0xFF;
+	ack_cmd[2] = ack_addr;
+	ack_cmd[3] = CY_SPI_WR_OP;
+	ack_cmd[4] = ack;
+
+	memset((void *)xfer, 0, sizeof(xfer));
+	spi_message_init(&msg);
+
+	xfer[0].tx_buf = rd_cmd;
+	xfer[0].rx_buf = rd_sync;
+	xfer[0].len = CY_SPI_CMD_BYTES;
+	spi_message_add_tail(&xfer[0], &msg);
+
+	n = 1 + cyttsp_spi_add_data(&msg, &xfer[1], NULL, data, length);
+	xfer[n - 1].cs_change = 1;
+
+	xfer[n].tx_buf = ack_cmd;
+	xfer[n].rx_buf = ack_sync;
+	xfer[n].len = CY_SPI_CMD_BYTES + 1;
+	spi_message_add_tail(&xfer[n], &msg);
+
+	retval = spi_sync(ts->spi_client, &msg);
+	if (retval < 0)
+		dev_dbg(ts->bus_ops.dev, "%s: spi_sync() error %d\n",
+			__func__, retval);
+	else if (!cyttsp_spi_sync_ok(rd_sync) || !cyttsp_spi_sync_ok(ack_sync))
+		retval = -EAGAIN;
+
+	mutex_unlock(&ts->lock);
+	return retval;
+}
+
 static s32 ttsp_spi_write_block_data(void *handle, u8 addr,
 				     u8 length, const void *data)
 {
@@ -174,11 +292,96 @@ static s32 ttsp_spi_write_block_data(void *handle, u8 addr,
 	 * to retry until data sync bytes are found.
 	 */
 	if (retval > 0)
-		retval = -EIO;  /* now signal fail; so retry can be done */
+		retval = -EAGAIN;  /* sync miss, see cyttsp_retry_wait() */
 
 	return retval;
 }
 
+static void cyttsp_spi_async_complete(void *context)
+{
+	struct cyttsp_spi_async *a = context;
+	struct cyttsp_spi *ts = a->ts;
+	void (*done)(void *context, int status) = a->done;
+	void *done_context = a->context;
+	int status = a->msg.status;
+
+	if (!status && !cyttsp_spi_sync_ok(a->ack_buf))
+		status = -EAGAIN;
+
+	/* the entry may be reused as soon as its bit is clear */
+	smp_mb__before_clear_bit();
+	clear_bit(a - ts->async, &ts->async_busy);
+
+	done(done_context, status);
+}
+
+static s32 ttsp_spi_read_block_data_async(void *handle, u8 addr,
+					  u8 length, void *data,
+					  void (*done)(void *context,
+						       int status),
+					  void *context)
+{
+	struct cyttsp_spi *ts =
+		container_of(handle, struct cyttsp_spi, bus_ops);
+	struct cyttsp_spi_async *a;
+	int retval;
+	int i;
+
+	/* the messages are built once with a single data transfer */
+	if (length > CY_SPI_DATA_SIZE)
+		return -EINVAL;
+
+	for (i = 0; i < CY_SPI_ASYNC_NUM; i++)
+		if (!test_and_set_bit(i, &ts->async_busy))
+			break;
+	if (i == CY_SPI_ASYNC_NUM)
+		return -EBUSY;
+
+	a = &ts->async[i];
+	a->cmd_buf[2] = addr;
+	a->ack_buf[CY_SPI_SYNC_BYTE] = 0;
+	a->ack_buf[CY_SPI_SYNC_BYTE + 1] = 0;
+	a->xfer[1].rx_buf = data;
+	a->xfer[1].len = length;
+	a->done = done;
+	a->context = context;
+
+	retval = spi_async(ts->spi_client, &a->msg);
+	if (retval < 0) {
+		dev_dbg(ts->bus_ops.dev, "%s: spi_async() error %d\n",
+			__func__, retval);
+		clear_bit(i, &ts->async_busy);
+	}
+
+	return retval;
+}
+
+/* Build the read messages once so that submitting one is just spi_async() */
+static void cyttsp_spi_async_init(struct cyttsp_spi *ts)
+{
+	struct cyttsp_spi_async *a;
+	int i;
+
+	for (i = 0; i < CY_SPI_ASYNC_NUM; i++) {
+		a = &ts->async[i];
+		a->ts = ts;
+
+		a->cmd_buf[0] = 0x00; /* header byte 0 */
+		a->cmd_buf[1] = 0xFF; /* header byte 1 */
+		a->cmd_buf[3] = CY_SPI_RD_OP;
+
+		spi_message_init(&a->msg);
+		a->msg.complete = cyttsp_spi_async_complete;
+		a->msg.context = a;
+
+		a->xfer[0].tx_buf = a->cmd_buf;
+		a->xfer[0].rx_buf = a->ack_buf;
+		a->xfer[0].len = CY_SPI_CMD_BYTES;
+		spi_message_add_tail(&a->xfer[0], &a->msg);
+		spi_message_add_tail(&a->xfer[1], &a->msg);
+	}
+}
+
 static int __devinit cyttsp_spi_probe(struct spi_device *spi)
 {
 	struct cyttsp_spi *ts;
@@ -200,15 +403,29 @@ static int __devinit cyttsp_spi_probe(struct spi_device *spi)
 		return -ENOMEM;
 	}
 
+	ts->bus_ops.frame_buf = kmalloc(L1_CACHE_ALIGN(CY_FRAME_BUF_SIZE),
+					GFP_KERNEL);
+	if (!ts->bus_ops.frame_buf) {
+		dev_dbg(&spi->dev, "%s: Error, kmalloc frame\n", __func__);
+		kfree(ts);
+		return -ENOMEM;
+	}
+
 	ts->spi_client = spi;
+	mutex_init(&ts->lock);
 	dev_set_drvdata(&spi->dev, ts);
 	ts->bus_ops.write = ttsp_spi_write_block_data;
 	ts->bus_ops.read = ttsp_spi_read_block_data;
+	ts->bus_ops.read_async = ttsp_spi_read_block_data_async;
+	ts->bus_ops.read_ack = ttsp_spi_read_block_data_ack;
+	ts->bus_ops.read_ack_slack = CY_SPI_ACK_SLACK;
 	ts->bus_ops.dev = &spi->dev;
+	cyttsp_spi_async_init(ts);
 
 	ts->ttsp_client = cyttsp_core_init(&ts->bus_ops, &spi->dev, spi->irq);
 	if (IS_ERR(ts->ttsp_client)) {
 		int retval = PTR_ERR(ts->ttsp_client);
+		kfree(ts->bus_ops.frame_buf);
 		kfree(ts);
 		return retval;
 	}
@@ -223,6 +440,7 @@ static int __devexit cyttsp_spi_remove(struct spi_device *spi)
 	struct cyttsp_spi *ts = dev_get_drvdata(&spi->dev);
 
 	cyttsp_core_release(ts->ttsp_client);
+	kfree(ts->bus_ops.frame_buf);
 	kfree(ts);
 	return 0;
 }
@@ -241,7 +459,36 @@ static int cyttsp_spi_resume(struct device *dev)
 
 	return cyttsp_resume(ts->ttsp_client);
 }
-static SIMPLE_DEV_PM_OPS(cyttsp_spi_pm, cyttsp_spi_suspend, cyttsp_spi_resume);
+
+#ifdef CONFIG_PM_RUNTIME
+static int cyttsp_spi_runtime_suspend(struct device *dev)
+{
+	struct cyttsp_spi *ts = dev_get_drvdata(dev);
+
+	return cyttsp_runtime_suspend(ts->ttsp_client);
+}
+
+static int cyttsp_spi_runtime_resume(struct device *dev)
+{
+	struct cyttsp_spi *ts = dev_get_drvdata(dev);
+
+	return cyttsp_runtime_resume(ts->ttsp_client);
+}
+
+/* let the autosuspend delay run out instead of suspending right away */
+static int cyttsp_spi_runtime_idle(struct device *dev)
+{
+	pm_runtime_autosuspend(dev);
+	return -EBUSY;
+}
+#endif
+
+static const struct dev_pm_ops cyttsp_spi_pm = {
+	SET_SYSTEM_SLEEP_PM_OPS(cyttsp_spi_suspend, cyttsp_spi_resume)
+	SET_RUNTIME_PM_OPS(cyttsp_spi_runtime_suspend,
+			   cyttsp_spi_runtime_resume,
+			   cyttsp_spi_runtime_idle)
+};
 #endif
 
 static struct spi_driver cyttsp_spi_driver = {